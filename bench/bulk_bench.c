@@ -0,0 +1,180 @@
+/*
+ * Compare the bulk copy / zero of large blocks (see bulk.h) with libc
+ * memcpy / memset:
+ *
+ * usage: bulk_bench [rounds]
+ *
+ * 1. Throughput of each size, best of rounds.
+ * 2. Cache pollution: a hot working set of half the L2 cache is read,
+ *    a large block is copied / zeroed, then the hot set is read again.
+ *    The second read is slower by the lines the block evicted.
+ * 3. my_malloc of a large free block which is not purged (zeroed by the
+ *    allocator), and my_realloc of a large block (copied).
+ *
+ * Streaming stores are used from bulk_threshold() bytes, run with
+ * MM_BULK_THRESHOLD=<bytes> to move the threshold, a large value gives
+ * the libc numbers in part 3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bulk.h"
+#include "mm.h"
+
+#define MB                  ((size_t)1024*1024)
+#define POLLUTION_BLOCK     (32*MB)
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+static void * alloc_touched(size_t size) {
+    void * ptr = aligned_alloc(4096, size);
+    if(ptr == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(ptr, 1, size);
+    return ptr;
+}
+
+/*
+ * Read one word per line of the hot set, return ns per line
+ */
+static volatile size_t sink;
+
+static double read_hot(const size_t * hot, size_t size) {
+    size_t sum = 0;
+    double start = now_ms();
+    for(size_t i = 0; i < size/sizeof(size_t); i += 64/sizeof(size_t)) {
+        sum += hot[i];
+    }
+    double elapsed = now_ms() - start;
+    sink = sum;
+    return elapsed*1e6/(size/64);
+}
+
+static void copy_libc(void * dst, const void * src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+static void zero_libc(void * dst, const void * src, size_t size) {
+    memset(dst, 0, size);
+}
+
+static void zero_bulk(void * dst, const void * src, size_t size) {
+    bulk_zero(dst, size);
+}
+
+typedef void (*move_t)(void * dst, const void * src, size_t size);
+
+static double best_gbps(move_t move, void * dst, const void * src, size_t size, int rounds) {
+    double best = 0;
+    for(int i = 0; i < rounds; i++) {
+        double start = now_ms();
+        move(dst, src, size);
+        double elapsed = now_ms() - start;
+        if(i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return (best > 0)?size/best/1e6:0;
+}
+
+static double pollution(move_t move, void * dst, const void * src, size_t * hot, size_t hot_size, int rounds) {
+    double best = 0;
+    for(int i = 0; i < rounds; i++) {
+        read_hot(hot, hot_size);
+        read_hot(hot, hot_size);
+        move(dst, src, POLLUTION_BLOCK);
+        double ns = read_hot(hot, hot_size);
+        if(i == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char * argv[]) {
+    int rounds = (argc > 1)?atoi(argv[1]):5;
+    if(rounds <= 0) {
+        rounds = 5;
+    }
+
+    size_t sizes[] = {256*1024, 1*MB, 4*MB, 16*MB, 64*MB};
+    size_t max_size = 64*MB;
+    void * src = alloc_touched(max_size);
+    void * dst = alloc_touched(max_size);
+
+    printf("streaming stores: %s, threshold %zu bytes\n\n", bulk_isa(), bulk_threshold());
+
+    // 1. Throughput
+    printf("%-10s %14s %14s %14s %14s\n", "GB/s", "memcpy", "bulk_copy", "memset", "bulk_zero");
+    for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        printf("%7zu KB %14.2f %14.2f %14.2f %14.2f\n", sizes[i]/1024,
+            best_gbps(copy_libc, dst, src, sizes[i], rounds),
+            best_gbps(bulk_copy, dst, src, sizes[i], rounds),
+            best_gbps(zero_libc, dst, src, sizes[i], rounds),
+            best_gbps(zero_bulk, dst, src, sizes[i], rounds));
+    }
+
+    // 2. Cache pollution
+    long l2_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    size_t hot_size = (l2_size > 0)?l2_size/2:512*1024;
+    size_t * hot = alloc_touched(hot_size);
+    double base = 0;
+    for(int i = 0; i < rounds; i++) {
+        read_hot(hot, hot_size);
+        double ns = read_hot(hot, hot_size);
+        if(i == 0 || ns < base) {
+            base = ns;
+        }
+    }
+    printf("\nhot set of %zu KB read again after moving %zu MB (ns per line, %.2f untouched)\n", hot_size/1024, POLLUTION_BLOCK/MB, base);
+    printf("%-10s %14.2f %14.2f %14.2f %14.2f\n", "",
+        pollution(copy_libc, dst, src, hot, hot_size, rounds),
+        pollution(bulk_copy, dst, src, hot, hot_size, rounds),
+        pollution(zero_libc, dst, src, hot, hot_size, rounds),
+        pollution(zero_bulk, dst, src, hot, hot_size, rounds));
+
+    // 3. Allocator, blocks freed dirty and reused at once (no purge)
+    my_set_purge_decay(-1);
+    printf("\n%-24s %10s %10s\n", "ms (best)", "my_malloc", "my_realloc");
+    for(size_t i = 1; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        double malloc_best = 0;
+        double realloc_best = 0;
+        for(int j = 0; j < rounds; j++) {
+            void * block = my_malloc(sizes[i]);
+            memset(block, 1, sizes[i]);
+            my_free(block);
+
+            double start = now_ms();
+            block = my_malloc(sizes[i]);
+            double elapsed = now_ms() - start;
+            malloc_best = (j == 0 || elapsed < malloc_best)?elapsed:malloc_best;
+
+            // The block after is taken, so realloc has to move it
+            void * fence = my_malloc(64);
+            start = now_ms();
+            void * moved = my_realloc(block, sizes[i] + 4096);
+            elapsed = now_ms() - start;
+            realloc_best = (j == 0 || elapsed < realloc_best)?elapsed:realloc_best;
+
+            my_free(fence);
+            my_free(moved);
+        }
+        printf("%18zu KB %10.3f %10.3f\n", sizes[i]/1024, malloc_best, realloc_best);
+    }
+
+    free(hot);
+    free(dst);
+    free(src);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,115 @@
+/*
+ * Compare std::pmr containers on the resources of mm_resource.hpp with
+ * the default resource (operator new / delete):
+ *
+ * usage: pmr_bench [rounds]
+ *
+ * Every workload runs rounds times on each resource, the best time is
+ * printed in ms.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mm_resource.hpp"
+
+static const int ELEMENTS = 200000;
+
+typedef std::function<void(std::pmr::memory_resource *)> workload_t;
+
+static void vector_growth(std::pmr::memory_resource * resource) {
+    for(int i = 0; i < 64; i++) {
+        std::pmr::vector<int> values(resource);
+        for(int j = 0; j < ELEMENTS/64; j++) {
+            values.push_back(j);
+        }
+    }
+}
+
+static void list_churn(std::pmr::memory_resource * resource) {
+    std::pmr::list<int> values(resource);
+    for(int i = 0; i < ELEMENTS; i++) {
+        values.push_back(i);
+        if(i % 3 == 0) {
+            values.pop_front();
+        }
+    }
+}
+
+static void map_churn(std::pmr::memory_resource * resource) {
+    std::pmr::map<int, int> values(resource);
+    for(int i = 0; i < ELEMENTS; i++) {
+        values[(i*7919) % ELEMENTS] = i;
+        if(i % 2 == 0) {
+            values.erase((i*104729) % ELEMENTS);
+        }
+    }
+}
+
+static void hash_strings(std::pmr::memory_resource * resource) {
+    std::pmr::unordered_map<std::pmr::string, int> values(resource);
+    for(int i = 0; i < ELEMENTS/2; i++) {
+        std::pmr::string key("key of a string long enough to allocate ", resource);
+        key += std::to_string(i);
+        values.emplace(std::move(key), i);
+    }
+}
+
+static double run(const workload_t & workload, std::pmr::memory_resource * resource, int rounds) {
+    double best = 0;
+    for(int i = 0; i < rounds; i++) {
+        auto start = std::chrono::steady_clock::now();
+        workload(resource);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if(i == 0 || elapsed.count() < best) {
+            best = elapsed.count();
+        }
+    }
+    return best;
+}
+
+int main(int argc, char * argv[]) {
+    int rounds = (argc > 1)?atoi(argv[1]):5;
+    if(rounds <= 0) {
+        rounds = 5;
+    }
+
+    struct {
+        const char * name;
+        workload_t workload;
+    } workloads[] = {
+        {"vector growth", vector_growth},
+        {"list churn", list_churn},
+        {"map churn", map_churn},
+        {"hash strings", hash_strings},
+    };
+
+    printf("%-16s %12s %12s %12s %12s %12s\n", "ms (best)", "new_delete", "std pool", "mm heap", "mm pool", "mm arena");
+    for(auto & w : workloads) {
+        std::pmr::unsynchronized_pool_resource std_pool;
+        mm::pool_resource mm_pool;
+        mm::arena_resource mm_arena;
+
+        double times[5];
+        times[0] = run(w.workload, std::pmr::new_delete_resource(), rounds);
+        times[1] = run(w.workload, &std_pool, rounds);
+        times[2] = run(w.workload, mm::default_resource(), rounds);
+        times[3] = run(w.workload, &mm_pool, rounds);
+        times[4] = run([&](std::pmr::memory_resource * resource) {
+            w.workload(resource);
+            mm_arena.release();
+        }, &mm_arena, rounds);
+
+        printf("%-16s %12.2f %12.2f %12.2f %12.2f %12.2f\n", w.name, times[0], times[1], times[2], times[3], times[4]);
+    }
+
+    return EXIT_SUCCESS;
+}
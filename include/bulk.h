@@ -0,0 +1,52 @@
+/*
+ * This file defines the copy and zeroing of large blocks
+ */
+
+#ifndef _BULK_H_
+#define _BULK_H_
+
+#include <stddef.h>
+
+/*
+ * Bulk Data Movement:
+ *
+ * memcpy / memset store through the cache: every line written is read
+ * first (read for ownership) and stays cached, so moving a multi-MB
+ * block evicts the working set of the application, for data which is
+ * usually not touched again soon.
+ *
+ * From bulk_threshold() bytes on, blocks are written with non-temporal
+ * (streaming) stores instead, whole lines going to memory through the
+ * write-combining buffers, without the read and without allocating
+ * lines in cache. The source of a copy is still read through the cache.
+ * Smaller blocks use memcpy / memset, which are faster when the data is
+ * used right after.
+ *
+ * The threshold is the size of the per-core L2 cache, or BULK_ENV bytes
+ * if set.
+ */
+#define BULK_ENV                "MM_BULK_THRESHOLD"
+#define BULK_DEFAULT_THRESHOLD  ((size_t)1024*1024)     // L2 size unknown
+#define BULK_MIN_THRESHOLD      ((size_t)64*1024)
+
+/*
+ * Copy size bytes from src to dst (not overlapping)
+ */
+void bulk_copy(void * dst, const void * src, size_t size);
+
+/*
+ * Zero size bytes at dst
+ */
+void bulk_zero(void * dst, size_t size);
+
+/*
+ * Return the size from which blocks are moved with streaming stores
+ */
+size_t bulk_threshold(void);
+
+/*
+ * Name of the instruction set of streaming stores ("avx2", "sse2" or "none")
+ */
+const char * bulk_isa(void);
+
+#endif
@@ -27,6 +27,10 @@
 #define KBWN ""
 #endif
 
+#ifdef TRACE
+#include "trace.h"
+#endif
+
 #ifdef VERBOSE
 #define DEBUG
 #define INFO
@@ -36,51 +40,71 @@
 #endif
 
 #ifdef DEBUG
+#ifdef TRACE
+#define debug(S, ...) trace(TRACE_DEBUG, S, ##__VA_ARGS__)
+#else
 #define debug(S, ...)                                                          \
   do {                                                                         \
     fprintf(stderr, KMAG "DEBUG: %s:%s:%d " KNRM S NL, __FILE__,               \
             __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
   } while (0)
+#endif
 #else
 #define debug(S, ...)
 #endif
 
 #ifdef INFO
+#ifdef TRACE
+#define info(S, ...) trace(TRACE_INFO, S, ##__VA_ARGS__)
+#else
 #define info(S, ...)                                                           \
   do {                                                                         \
     fprintf(stderr, KBLU "INFO: %s:%s:%d " KNRM S NL, __FILE__,                \
             __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
   } while (0)
+#endif
 #else
 #define info(S, ...)
 #endif
 
 #ifdef WARN
+#ifdef TRACE
+#define warn(S, ...) trace(TRACE_WARN, S, ##__VA_ARGS__)
+#else
 #define warn(S, ...)                                                           \
   do {                                                                         \
     fprintf(stderr, KYEL "WARN: %s:%s:%d " KNRM S NL, __FILE__,                \
             __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
   } while (0)
+#endif
 #else
 #define warn(S, ...)
 #endif
 
 #ifdef SUCCESS
+#ifdef TRACE
+#define success(S, ...) trace(TRACE_SUCCESS, S, ##__VA_ARGS__)
+#else
 #define success(S, ...)                                                        \
   do {                                                                         \
     fprintf(stderr, KGRN "SUCCESS: %s:%s:%d " KNRM S NL, __FILE__,             \
             __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
   } while (0)
+#endif
 #else
 #define success(S, ...)
 #endif
 
 #ifdef ERROR
+#ifdef TRACE
+#define error(S, ...) trace(TRACE_ERROR, S, ##__VA_ARGS__)
+#else
 #define error(S, ...)                                                          \
   do {                                                                         \
     fprintf(stderr, KRED "ERROR: %s:%s:%d " KNRM S NL, __FILE__,               \
             __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
   } while (0)
+#endif
 #else
 #define error(S, ...)
 #endif
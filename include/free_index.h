@@ -0,0 +1,90 @@
+/*
+ * This file defines the out-of-band index of free block sizes
+ */
+
+#ifndef _FREE_INDEX_H_
+#define _FREE_INDEX_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Free Index Layout:
+ *
+ * keys    | k0 | k1 | k2 | ... | k(count-1) |      32-bit, block size in KEY_UNIT
+ * offsets | o0 | o1 | o2 | ... | o(count-1) |      offset of block from heap start
+ *
+ * Entry i describes the same free block in both arrays. Keys are stored
+ * contiguously so the fit search could compare 8 (AVX2) or 4 (SSE2) keys
+ * per instruction, instead of loading a block header per free block.
+ *
+ * Entries are appended on insert, so entries are in the order blocks 
+ * were inserted. A delete finds the entry by a hash of offsets and sets
+ * its key to 0, which never fits, without moving the other entries. The
+ * deleted entries are dropped once they are half of the index, keeping
+ * the order (see compact_index), deletes are O(1) amortized.
+ */
+
+#ifdef MM_COMPACT
+#define INDEX_KEY_SHIFT     3                       // Key unit is 8 bytes (compact block alignment)
+#else
+#define INDEX_KEY_SHIFT     4                       // Key unit is 16 bytes (block alignment)
+#endif
+#define INDEX_KEY_MAX       UINT32_MAX              // Saturated key, the block must be checked
+
+typedef struct free_index {
+    uint32_t * keys;
+    size_t * offsets;
+    uint32_t * slots;           // Hash of offsets (see find_slot)
+    size_t count;               // Entries, deleted ones included
+    size_t deleted;             // Entries with key 0
+    size_t capacity;
+    size_t slot_capacity;
+    size_t rover;               // Next-fit / good-fit position, follows compaction
+    int out_of_sync;            // Set if the index could not be maintained (allocation failure)
+}free_index_t;
+
+/*
+ * Return the key of a block of size bytes, rounded up
+ */
+uint32_t free_index_key(size_t size);
+
+/*
+ * Add a free block to index
+ */
+int free_index_insert(free_index_t * index, size_t size, size_t offset);
+
+/*
+ * Remove a free block from index, return -1 if the index is not maintained
+ */
+int free_index_delete(free_index_t * index, size_t offset);
+
+/*
+ * Return the position of the first entry (at or after start) whose key is
+ * not smaller than key, or -1 if none.
+ */
+ssize_t free_index_first_fit(free_index_t * index, uint32_t key, size_t start);
+
+/*
+ * Return the position of the last entry (before end) whose key is not
+ * smaller than key, or -1 if none.
+ */
+ssize_t free_index_last_fit(free_index_t * index, uint32_t key, size_t end);
+
+/*
+ * Return the position of the entry with the smallest key not smaller than
+ * key, or -1 if none.
+ */
+ssize_t free_index_best_fit(free_index_t * index, uint32_t key);
+
+/*
+ * Unmap the arrays of index
+ */
+void free_index_release(free_index_t * index);
+
+/*
+ * Name of the instruction set used to scan indexes ("avx2", "sse2" or "scalar")
+ */
+const char * free_index_isa(void);
+
+#endif
@@ -19,6 +19,9 @@
  * Also, when split the memory blocks, the minimal block size would 
  * be 16 bytes.
  * 
+ * Built with the compact layout (make compact), heaps are limited to 
+ * 4 GB, and blocks are 8 bytes aligned with 8 bytes of boundary tags,
+ * so malloc(1) only takes 16 bytes in total.
  */
 void * my_malloc(size_t size);
 
@@ -33,6 +36,22 @@ void * my_malloc(size_t size);
  */
 int my_free(void * ptr);
 
+/*
+ * Free a block of my_malloc(size) (any heap), size being known by the
+ * caller, e.g. a C++ deallocate(p, n). Release builds skip the block
+ * validation of my_free, debug builds check size against the block.
+ */
+int my_free_sized(void * ptr, size_t size);
+
+/*
+ * Alignment of blocks returned by my_malloc
+ */
+#ifdef MM_COMPACT
+#define MM_ALIGNMENT            8
+#else
+#define MM_ALIGNMENT            16
+#endif
+
 /*
  * Just implementation of malloc(n_elements*element_size)
  * 
@@ -47,4 +66,427 @@ void * my_calloc(size_t n_elements, size_t element_size);
  */
 void * my_realloc(void * p, size_t size);
 
-#endif
\ No newline at end of file
+/*
+ * Lifetime Hints:
+ * 
+ * my_malloc_hint places blocks of each lifetime class in its own heap,
+ * so that short-lived buffers do not leave holes between long-lived
+ * objects, and freeing them leaves contiguous free space to trim.
+ * 
+ * MM_LONG_LIVED   The default heap, same as my_malloc.
+ * MM_SHORT_LIVED  Buffers freed soon after allocated.
+ * MM_COLD         Objects kept but rarely touched, away from the pages
+ *                 of hot objects.
+ * 
+ * The heaps of MM_SHORT_LIVED and MM_COLD are created on first use, and
+ * are trimmed and purged with the default heap. Blocks are freed with
+ * my_free as usual.
+ */
+#define MM_LONG_LIVED           0
+#define MM_SHORT_LIVED          1
+#define MM_COLD                 2
+#define MM_LIFETIME_COUNT       3
+
+void * my_malloc_hint(size_t size, int lifetime);
+
+/*
+ * Release the free space at the end of heap to the system, keeping
+ * pad bytes available in the last block.
+ * 
+ * With huge pages enabled, memory is only released in whole huge pages.
+ */
+int my_trim(size_t pad);
+
+/*
+ * Back the heap with transparent huge pages (madvise(MADV_HUGEPAGE)):
+ * 
+ * Heap extensions of at least one huge page are rounded up so that the
+ * heap ends on a huge page boundary, and my_trim releases whole huge 
+ * pages only.
+ * 
+ * Return -1 if transparent huge pages are disabled in the system, the
+ * heap keeps using normal pages in that case.
+ */
+int my_set_huge_page(int enable);
+
+/*
+ * Placement Policies:
+ * 
+ * MM_POLICY_SEGREGATED  Newest fitting block for small requests, best
+ *                       fit for others (default).
+ * MM_POLICY_FIRST_FIT   Fitting block at the lowest address.
+ * MM_POLICY_NEXT_FIT    First fitting block after the previous one found.
+ * MM_POLICY_BEST_FIT    Smallest fitting block.
+ * MM_POLICY_GOOD_FIT    Bounded search from the previous block found, 
+ *                       taking the first block close enough to the 
+ *                       request size, or the best of a few.
+ * 
+ * Every policy first searches the free list of the request size, then
+ * the lists of larger blocks. A heap uses the policy named by the 
+ * MM_POLICY environment variable ("segregated", "first-fit", "next-fit",
+ * "best-fit" or "good-fit") unless set by my_set_policy.
+ * 
+ * my_policy_stats counts the requests served by each policy, and the 
+ * heap extensions they caused, to compare policies on a workload.
+ */
+#define MM_POLICY_SEGREGATED    0
+#define MM_POLICY_FIRST_FIT     1
+#define MM_POLICY_NEXT_FIT      2
+#define MM_POLICY_BEST_FIT      3
+#define MM_POLICY_GOOD_FIT      4
+#define MM_POLICY_COUNT         5
+
+typedef struct my_policy_stats {
+    size_t requests[MM_POLICY_COUNT];       // Allocations served by each policy
+    size_t extensions[MM_POLICY_COUNT];     // Heap extensions, no free block fit
+}my_policy_stats_t;
+
+int my_set_policy(int policy);
+
+int my_get_policy(void);
+
+/*
+ * Return the name of policy, as accepted in MM_POLICY
+ */
+const char * my_policy_name(int policy);
+
+int my_policy_stats(my_policy_stats_t * stats);
+
+/*
+ * Purging:
+ * 
+ * Free blocks of 64 KB or more give their pages back to the system
+ * (madvise(MADV_DONTNEED)) once they stay free for the decay time, 
+ * 1000 ms by default, so that pages of a block freed and reused quickly
+ * are not faulted again. Purged pages are not zeroed again by my_malloc.
+ * 
+ * Purging is done every few my_malloc / my_free calls, or by a 
+ * background thread started with my_purge_thread(1). The thread must be
+ * started and stopped while no other thread uses the allocator.
+ * 
+ * A negative decay_ms disables purging, my_purge purges every free
+ * block at once.
+ */
+int my_set_purge_decay(long decay_ms);
+
+int my_purge(void);
+
+int my_purge_thread(int enable);
+
+/*
+ * Pre-warming:
+ * 
+ * my_reserve grows the heap once so that at least bytes are free, and
+ * faults the pages in (madvise(MADV_POPULATE_WRITE), or a write to each
+ * page on older kernels), so the first requests after startup neither
+ * extend the heap nor fault pages. Reserved pages are not purged until
+ * used, my_trim still releases the free space at the end of heap.
+ * 
+ * profile (NULL for none) is an array of size classes ended by a zero
+ * size. The reserved space is split into count free blocks of each 
+ * size, so that requests of these sizes take a block without splitting
+ * one. The heap grows further if the profile needs more than bytes.
+ */
+typedef struct my_reserve_class {
+    size_t size;                // Request size, as given to my_malloc
+    size_t count;               // Free blocks of size to make
+}my_reserve_class_t;
+
+int my_reserve(size_t bytes, const my_reserve_class_t * profile);
+
+/*
+ * Memory Budget:
+ * 
+ * my_set_budget limits the size of the default heap (0 for no limit).
+ * Before the heap grows past the soft limit, the allocator frees the 
+ * blocks queued by my_free_deferred, compacts movable blocks and purges
+ * free blocks. If no block fits yet, the callbacks registered with 
+ * my_add_reclaim are called one by one with the bytes needed, and should
+ * free cached blocks and return the bytes freed. Only then the heap 
+ * grows past the soft limit. It never grows past the hard limit, 
+ * my_malloc returns NULL instead. While the heap is past the soft limit,
+ * it is relieved again at most every 100 ms or 1/8 of the soft limit grown.
+ * 
+ * Callbacks are called without the heap locked, allocations they make
+ * are not relieved again.
+ */
+#define MM_MAX_RECLAIMS         8
+
+typedef size_t (*my_reclaim_t)(size_t needed, void * arg);
+
+typedef struct my_budget_stats {
+    size_t committed;           // Bytes of heap now
+    size_t peak;                // Largest heap size reached
+    size_t soft_limit;
+    size_t hard_limit;
+    size_t pressure;            // Extensions held back by the budget
+    size_t relieved;            // ... served after internal reclamation
+    size_t skipped;             // ... extended past the soft limit without relief
+    size_t callback_calls;
+    size_t callback_bytes;      // Bytes reported freed by callbacks
+    size_t overruns;            // Extensions past the soft limit
+    size_t denied;              // Allocations refused at the hard limit
+}my_budget_stats_t;
+
+int my_set_budget(size_t soft, size_t hard);
+
+int my_add_reclaim(my_reclaim_t fn, void * arg);
+
+int my_remove_reclaim(my_reclaim_t fn, void * arg);
+
+int my_budget_stats(my_budget_stats_t * stats);
+
+/*
+ * Deferred Free:
+ * 
+ * my_free_deferred queues a block (from any heap) on a lock-free queue
+ * and returns at once, leaving validation, coalescing and insertion to
+ * the reclaimer thread started with my_reclaim_thread(1). It wakes every
+ * 10 ms, or early once 1024 blocks are queued. Without the thread, the
+ * queue is only drained by my_free_drain, which frees every queued 
+ * block in the calling thread, e.g. before retrying a failed my_malloc.
+ * 
+ * Like my_free, a block must be queued only once. Blocks from my_halloc
+ * are not accepted. The lag is the time the oldest block of a drain 
+ * stayed queued.
+ */
+typedef struct my_deferred_stats {
+    size_t depth;               // Blocks queued, not yet freed
+    size_t reclaimed;           // Blocks taken from the queue
+    size_t failed;              // Blocks found invalid when drained
+    size_t batches;             // Drains which found queued blocks
+    size_t last_lag_ms;         // Lag of the last drain
+    size_t max_lag_ms;          // Longest lag seen
+}my_deferred_stats_t;
+
+int my_free_deferred(void * ptr);
+
+int my_free_drain(void);
+
+int my_deferred_stats(my_deferred_stats_t * stats);
+
+int my_reclaim_thread(int enable);
+
+/*
+ * Movable Blocks:
+ * 
+ * my_halloc returns a handle instead of an address. The block may be 
+ * moved by the allocator while it is not locked, my_hlock pins it and
+ * returns its current address, valid until the matching my_hunlock.
+ * Locks nest. A movable block is freed by my_hfree, not my_free, and
+ * must not be passed to my_realloc.
+ * 
+ * my_compact_step slides unlocked movable blocks toward the heap start,
+ * so free space gathers at the end of heap, in slices of about budget
+ * bytes moved. Once a pass reaches the end of heap, the free tail is 
+ * trimmed and 1 is returned, 0 if the pass is not finished yet, -1 on
+ * error. Locked blocks and blocks from my_malloc stay in place, and 
+ * only the free space right before a movable block is reclaimed.
+ * 
+ * The handle table is not saved in persistent heaps.
+ */
+typedef size_t my_handle_t;
+
+my_handle_t my_halloc(size_t size);
+
+void * my_hlock(my_handle_t handle);
+
+int my_hunlock(my_handle_t handle);
+
+int my_hfree(my_handle_t handle);
+
+int my_compact_step(size_t budget);
+
+/*
+ * Heaps:
+ * 
+ * The my_* functions above work on the default heap. mm_heap_create
+ * makes another heap, isolated from the default heap and from each
+ * other. Like the default heap, its address space of max_size bytes 
+ * (64 GB, or MM_RESERVE_SIZE from environment, if 0) is reserved up
+ * front and committed as it grows.
+ * 
+ * mm_heap_destroy releases every block of a heap at once, without 
+ * walking them. my_free and my_realloc also accept blocks of any heap.
+ */
+typedef struct mm_heap mm_heap_t;
+
+mm_heap_t * mm_heap_create(size_t max_size);
+
+int mm_heap_destroy(mm_heap_t * h);
+
+/*
+ * Return the heap used by my_malloc
+ */
+mm_heap_t * mm_heap_default(void);
+
+void * mm_heap_malloc(mm_heap_t * h, size_t size);
+
+int mm_heap_free(mm_heap_t * h, void * ptr);
+
+int mm_heap_free_sized(mm_heap_t * h, void * ptr, size_t size);
+
+void * mm_heap_calloc(mm_heap_t * h, size_t n_elements, size_t element_size);
+
+void * mm_heap_realloc(mm_heap_t * h, void * p, size_t size);
+
+int mm_heap_trim(mm_heap_t * h, size_t pad);
+
+int mm_heap_set_huge_page(mm_heap_t * h, int enable);
+
+int mm_heap_set_policy(mm_heap_t * h, int policy);
+
+int mm_heap_get_policy(mm_heap_t * h);
+
+int mm_heap_policy_stats(mm_heap_t * h, my_policy_stats_t * stats);
+
+int mm_heap_set_purge_decay(mm_heap_t * h, long decay_ms);
+
+int mm_heap_purge(mm_heap_t * h);
+
+int mm_heap_reserve(mm_heap_t * h, size_t bytes, const my_reserve_class_t * profile);
+
+my_handle_t mm_heap_halloc(mm_heap_t * h, size_t size);
+
+void * mm_heap_hlock(mm_heap_t * h, my_handle_t handle);
+
+int mm_heap_hunlock(mm_heap_t * h, my_handle_t handle);
+
+int mm_heap_hfree(mm_heap_t * h, my_handle_t handle);
+
+int mm_heap_compact_step(mm_heap_t * h, size_t budget);
+
+int mm_heap_set_budget(mm_heap_t * h, size_t soft, size_t hard);
+
+int mm_heap_add_reclaim(mm_heap_t * h, my_reclaim_t fn, void * arg);
+
+int mm_heap_remove_reclaim(mm_heap_t * h, my_reclaim_t fn, void * arg);
+
+int mm_heap_budget_stats(mm_heap_t * h, my_budget_stats_t * stats);
+
+/*
+ * Persistent Heap:
+ * 
+ * my_persist_open maps the file at path (a regular file, or a shared 
+ * memory object under /dev/shm) as the heap, instead of anonymous 
+ * memory. It must be called before the first allocation. The address
+ * space of max_size bytes is reserved up front so the heap stays
+ * contiguous, the default reservation if 0 (as mm_heap_create).
+ * 
+ * my_persist_close writes the heap back and unmaps it. The next 
+ * my_persist_open of the same file continues with every block 
+ * allocated before, without rebuilding them.
+ * 
+ * The heap is mapped at its previous address if it's still available.
+ * Otherwise, pointers stored inside blocks are no longer valid (the
+ * allocator itself only keeps offsets), application data should be 
+ * found from the root object.
+ * 
+ * Return -1 if the file is not a heap file, or was not closed cleanly.
+ */
+int my_persist_open(const char * path, size_t max_size);
+
+int my_persist_close(void);
+
+/*
+ * Set / get the root object (a block of the persistent heap) from which
+ * the application finds its data after reopening.
+ */
+int my_persist_set_root(void * root);
+
+void * my_persist_get_root(void);
+
+/*
+ * Heap Profiler:
+ * 
+ * my_profile_set_rate(rate) samples about one allocation every rate 
+ * bytes allocated (a Poisson process over bytes), recording the stack
+ * of the caller with backtrace(). A sampled block is retired from the
+ * profile when freed. 0 stops sampling (the default), my_malloc then 
+ * pays one counter decrement.
+ * 
+ * my_profile_dump writes the live and total sampled bytes per stack in
+ * the heap profile format of gperftools, e.g. "pprof --text bin/mm path".
+ */
+int my_profile_set_rate(size_t rate);
+
+int my_profile_dump(const char * path);
+
+/*
+ * Write the events traced by the debug macros (built with make trace) to
+ * path, to be read with bin/trace_decode. Set MM_TRACE to a path to dump
+ * at exit.
+ */
+int my_trace_dump(const char * path);
+
+/*
+ * Fixed-size Object Pool:
+ * 
+ * 1. Slots of one size are carved from chunks obtained from the heap
+ *    with my_malloc (or from the chunk allocator given to 
+ *    my_pool_create_with), each chunk being larger than the previous one.
+ * 2. Freed slots are kept in an intrusive free list (the link is stored
+ *    in the first word of the slot) and are reused before carving.
+ * 3. Chunks are only returned to the heap by my_pool_destroy.
+ * 
+ * Unlike my_malloc, slots returned by my_pool_alloc are NOT zeroed.
+ * A pool is not meant to be shared by several threads.
+ */
+typedef struct my_pool my_pool_t;
+
+typedef struct my_pool_stats {
+    size_t obj_size;            // Object size given to my_pool_create
+    size_t slot_size;           // Object size after alignment
+    size_t chunk_count;         // Chunks obtained from the heap
+    size_t chunk_bytes;         // Bytes obtained from the heap for chunks
+    size_t slots_total;         // Slots carved from chunks so far
+    size_t slots_in_use;        // Slots currently allocated
+    size_t slots_high_water;    // Maximum of slots_in_use since creation
+    size_t bytes_high_water;    // slots_high_water * slot_size
+}my_pool_stats_t;
+
+/*
+ * Create a pool of obj_size objects aligned to align bytes.
+ * align must be 0 (default alignment of my_malloc) or a power of two.
+ */
+my_pool_t * my_pool_create(size_t obj_size, size_t align);
+
+/*
+ * Chunk allocator of a pool: alloc returns size bytes aligned to 
+ * MM_ALIGNMENT, or NULL. free releases a chunk returned by alloc, given
+ * the same size, and returns 0 on success.
+ */
+typedef struct my_pool_chunk_ops {
+    void * (*alloc)(size_t size, void * arg);
+    int (*free)(void * chunk, size_t size, void * arg);
+    void * arg;
+}my_pool_chunk_ops_t;
+
+/*
+ * Create a pool like my_pool_create, whose chunks are obtained from ops
+ * instead of my_malloc unless ops is NULL. The pool itself still comes
+ * from my_malloc.
+ */
+my_pool_t * my_pool_create_with(size_t obj_size, size_t align, const my_pool_chunk_ops_t * ops);
+
+/*
+ * Take one slot from the pool, grow the pool by one chunk if necessary.
+ */
+void * my_pool_alloc(my_pool_t * pool);
+
+/*
+ * Return one slot to the pool.
+ */
+int my_pool_free(my_pool_t * pool, void * ptr);
+
+/*
+ * Release every chunk of the pool, and the pool itself.
+ */
+int my_pool_destroy(my_pool_t * pool);
+
+/*
+ * Fill stats with the current statistics of the pool.
+ */
+int my_pool_stats(my_pool_t * pool, my_pool_stats_t * stats);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ * This file defines C++ memory resources and allocators backed by the heap
+ */
+
+#ifndef _MM_RESOURCE_HPP_
+#define _MM_RESOURCE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+extern "C" {
+#include "mm.h"
+}
+
+namespace mm {
+
+/*
+ * Memory resource of a heap (the default heap unless given).
+ *
+ * deallocate(p, n, align) passes n to mm_heap_free_sized, so the block
+ * is freed without the validation of my_free in release builds.
+ * Alignments above MM_ALIGNMENT are served from a larger block, the
+ * address of the block being kept in the word before the aligned one.
+ */
+class heap_resource : public std::pmr::memory_resource {
+public:
+    explicit heap_resource(mm_heap_t * heap = mm_heap_default()) noexcept : heap_(heap) {}
+
+    mm_heap_t * heap() const noexcept {
+        return heap_;
+    }
+
+protected:
+    void * do_allocate(std::size_t bytes, std::size_t align) override {
+        if(align <= MM_ALIGNMENT) {
+            void * ptr = mm_heap_malloc(heap_, bytes);
+            if(ptr == nullptr) {
+                throw std::bad_alloc();
+            }
+            return ptr;
+        }
+
+        if(bytes > std::numeric_limits<std::size_t>::max() - align) {
+            throw std::bad_alloc();
+        }
+        void * block = mm_heap_malloc(heap_, bytes + align);
+        if(block == nullptr) {
+            throw std::bad_alloc();
+        }
+        // At least MM_ALIGNMENT bytes above block, room for the address
+        void * ptr = reinterpret_cast<void *>((reinterpret_cast<std::uintptr_t>(block) + align) & ~(align - 1));
+        static_cast<void **>(ptr)[-1] = block;
+        return ptr;
+    }
+
+    void do_deallocate(void * ptr, std::size_t bytes, std::size_t align) override {
+        if(align <= MM_ALIGNMENT) {
+            mm_heap_free_sized(heap_, ptr, bytes);
+        }
+        else {
+            mm_heap_free_sized(heap_, static_cast<void **>(ptr)[-1], bytes + align);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override {
+        const heap_resource * resource = dynamic_cast<const heap_resource *>(&other);
+        return resource != nullptr && resource->heap_ == heap_;
+    }
+
+private:
+    mm_heap_t * heap_;
+};
+
+/*
+ * Resource of the default heap
+ */
+inline heap_resource * default_resource() noexcept {
+    static heap_resource resource;
+    return &resource;
+}
+
+/*
+ * Pool resource:
+ *
+ * Requests up to max_size bytes are served by one my_pool_t per size
+ * class (multiples of MM_ALIGNMENT), created on first use, whose chunks
+ * are allocated from upstream. Larger or over-aligned requests go to 
+ * upstream directly. The size given to deallocate finds the pool, slots
+ * are never looked up.
+ *
+ * Like my_pool_t, it's not synchronized. Chunks go back to upstream with
+ * release() or when the resource is destroyed.
+ */
+class pool_resource : public std::pmr::memory_resource {
+public:
+    static constexpr std::size_t max_size = 512;
+
+    explicit pool_resource(std::pmr::memory_resource * upstream = default_resource()) noexcept : upstream_(upstream), pools_() {}
+
+    pool_resource(const pool_resource &) = delete;
+    pool_resource & operator=(const pool_resource &) = delete;
+
+    ~pool_resource() override {
+        release();
+    }
+
+    void release() noexcept {
+        for(my_pool_t *& pool : pools_) {
+            if(pool != nullptr) {
+                my_pool_destroy(pool);
+                pool = nullptr;
+            }
+        }
+    }
+
+    std::pmr::memory_resource * upstream_resource() const noexcept {
+        return upstream_;
+    }
+
+protected:
+    void * do_allocate(std::size_t bytes, std::size_t align) override {
+        if(bytes > max_size || align > MM_ALIGNMENT) {
+            return upstream_->allocate(bytes, align);
+        }
+
+        std::size_t index = size_class(bytes);
+        if(pools_[index] == nullptr) {
+            my_pool_chunk_ops_t ops = {chunk_alloc, chunk_free, upstream_};
+            pools_[index] = my_pool_create_with((index + 1)*MM_ALIGNMENT, 0, &ops);
+            if(pools_[index] == nullptr) {
+                throw std::bad_alloc();
+            }
+        }
+        void * ptr = my_pool_alloc(pools_[index]);
+        if(ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void * ptr, std::size_t bytes, std::size_t align) override {
+        if(bytes > max_size || align > MM_ALIGNMENT) {
+            upstream_->deallocate(ptr, bytes, align);
+        }
+        else {
+            my_pool_free(pools_[size_class(bytes)], ptr);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    static std::size_t size_class(std::size_t bytes) noexcept {
+        return (bytes == 0)?0:(bytes - 1)/MM_ALIGNMENT;
+    }
+
+    // Called from C, exceptions of upstream must not cross my_pool_alloc
+    static void * chunk_alloc(std::size_t size, void * upstream) noexcept {
+        try {
+            return static_cast<std::pmr::memory_resource *>(upstream)->allocate(size, MM_ALIGNMENT);
+        }
+        catch(...) {
+            return nullptr;
+        }
+    }
+
+    static int chunk_free(void * chunk, std::size_t size, void * upstream) noexcept {
+        static_cast<std::pmr::memory_resource *>(upstream)->deallocate(chunk, size, MM_ALIGNMENT);
+        return 0;
+    }
+
+    std::pmr::memory_resource * upstream_;
+    my_pool_t * pools_[max_size/MM_ALIGNMENT];
+};
+
+/*
+ * Arena resource:
+ *
+ * Allocations are carved from chunks of a heap of its own (see
+ * mm_heap_create), chunks growing from 4 KB to 1 MB. deallocate does
+ * nothing, release() drops the whole heap at once with mm_heap_destroy,
+ * without walking the blocks. Not synchronized.
+ */
+class arena_resource : public std::pmr::memory_resource {
+public:
+    static constexpr std::size_t min_chunk = 4*1024;
+    static constexpr std::size_t max_chunk = 1024*1024;
+
+    explicit arena_resource(std::size_t max_heap_size = 0) noexcept
+        : max_heap_size_(max_heap_size), heap_(nullptr), next_(nullptr), end_(nullptr), chunk_size_(min_chunk) {}
+
+    arena_resource(const arena_resource &) = delete;
+    arena_resource & operator=(const arena_resource &) = delete;
+
+    ~arena_resource() override {
+        release();
+    }
+
+    void release() noexcept {
+        if(heap_ != nullptr) {
+            mm_heap_destroy(heap_);
+        }
+        heap_ = nullptr;
+        next_ = end_ = nullptr;
+        chunk_size_ = min_chunk;
+    }
+
+protected:
+    void * do_allocate(std::size_t bytes, std::size_t align) override {
+        std::uintptr_t end = reinterpret_cast<std::uintptr_t>(end_);
+        std::uintptr_t ptr = (reinterpret_cast<std::uintptr_t>(next_) + align - 1) & ~(align - 1);
+        if(next_ == nullptr || ptr > end || bytes > end - ptr) {
+            if(bytes > std::numeric_limits<std::size_t>::max() - align) {
+                throw std::bad_alloc();
+            }
+            new_chunk(bytes + align);
+            ptr = (reinterpret_cast<std::uintptr_t>(next_) + align - 1) & ~(align - 1);
+        }
+        next_ = reinterpret_cast<char *>(ptr + bytes);
+        return reinterpret_cast<void *>(ptr);
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    void new_chunk(std::size_t bytes) {
+        if(heap_ == nullptr) {
+            heap_ = mm_heap_create(max_heap_size_);
+            if(heap_ == nullptr) {
+                throw std::bad_alloc();
+            }
+        }
+
+        std::size_t size = (bytes > chunk_size_)?bytes:chunk_size_;
+        char * chunk = static_cast<char *>(mm_heap_malloc(heap_, size));
+        if(chunk == nullptr) {
+            throw std::bad_alloc();
+        }
+        next_ = chunk;
+        end_ = chunk + size;
+        if(chunk_size_ < max_chunk) {
+            chunk_size_ *= 2;
+        }
+    }
+
+    std::size_t max_heap_size_;
+    mm_heap_t * heap_;
+    char * next_;
+    char * end_;
+    std::size_t chunk_size_;
+};
+
+/*
+ * Allocator of the default heap for standard containers, deallocate
+ * uses my_free_sized.
+ */
+template<class T>
+class allocator {
+public:
+    using value_type = T;
+
+    static_assert(alignof(T) <= MM_ALIGNMENT, "Over-aligned type, use heap_resource");
+
+    allocator() noexcept = default;
+
+    template<class U>
+    allocator(const allocator<U> &) noexcept {}
+
+    T * allocate(std::size_t n) {
+        if(n > std::numeric_limits<std::size_t>::max()/sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        T * ptr = static_cast<T *>(my_malloc(n*sizeof(T)));
+        if(ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void deallocate(T * ptr, std::size_t n) noexcept {
+        my_free_sized(ptr, n*sizeof(T));
+    }
+};
+
+template<class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+    return true;
+}
+
+template<class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+    return false;
+}
+
+}
+
+#endif
@@ -5,25 +5,149 @@
 #ifndef _PORT_H_
 #define _PORT_H_
 
+#include <stdint.h>
 #include <unistd.h>
 
 #define PAGE_SIZE (sysconf(_SC_PAGE_SIZE)) // 4K page size in Linux x64
+#define DEFAULT_HUGE_PAGE_SIZE (2*1024*1024) // PMD size in Linux x64
+
+#ifdef MM_COMPACT
+#define MAX_RESERVE_SIZE ((size_t)4*1024*1024*1024 - DEFAULT_HUGE_PAGE_SIZE) // Offsets of compact layout are 32-bit
+#define DEFAULT_RESERVE_SIZE MAX_RESERVE_SIZE
+#else
+#define MAX_RESERVE_SIZE SIZE_MAX
+#define DEFAULT_RESERVE_SIZE ((size_t)64*1024*1024*1024) // Address space reserved per heap
+#endif
+#define RESERVE_SIZE_ENV "MM_RESERVE_SIZE" // Overrides DEFAULT_RESERVE_SIZE
+
+#define PORT_BACKEND_NONE       0   // Not yet reserved, reserves on first extension
+#define PORT_BACKEND_FILE       1   // Heap file mapped over reserved address space
+#define PORT_BACKEND_RESERVE    2   // Anonymous reserved address space, committed as heap grows
+
+/*
+ * State of one heap, every port function takes the heap it works on.
+ * 
+ * A zeroed port_t with file_fd = -1 (PORT_INITIALIZER) is a heap 
+ * without backend, not yet initialized.
+ */
+typedef struct port {
+    int init_status;
+    int backend;
+    void * heap_start;
+    void * heap_end;
+    int huge_page;              // Heap backed by transparent huge pages
+    int file_fd;                // Heap file (file backend)
+    void * reservation;         // Start of reserved address space (file / reserve backend)
+    size_t reserved;            // Bytes of reserved address space
+}port_t;
+
+#define PORT_INITIALIZER {0, PORT_BACKEND_NONE, NULL, NULL, 0, -1, NULL, 0}
 
 /*
  * Return the start of heap (accessable from the return address)
  * 
  */
-void * port_get_mem_pool_start(void);
+void * port_get_mem_pool_start(port_t * port);
 
 /*
  * Return the end of heap (not accessable from the return address)
  * 
  */
-void * port_get_mem_pool_end(void);
+void * port_get_mem_pool_end(port_t * port);
 
 /*
  * Extend heap n pages from footer
  */
-int port_extend_page(int count);
+int port_extend_page(port_t * port, int count);
+
+/*
+ * Shrink heap n pages from footer
+ */
+int port_shrink_page(port_t * port, int count);
+
+/*
+ * Return the transparent huge page size, or 0 if huge pages are unsupported
+ */
+size_t port_huge_page_size(void);
+
+/*
+ * Enable or disable transparent huge pages for the heap
+ * 
+ * Return -1 if huge pages are unavailable, in which case the heap keeps
+ * using normal pages.
+ */
+int port_set_huge_page(port_t * port, int enable);
+
+/*
+ * Return 1 if the heap is backed by transparent huge pages
+ */
+int port_get_huge_page(port_t * port);
+
+/*
+ * Release the physical pages of [addr, addr + size) (page aligned) to
+ * the system, keeping the address space in heap. The pages read as 
+ * zero when touched again.
+ * 
+ * Return -1 if the pages could not be released (pages of a heap file 
+ * are kept, they would be read back from the file).
+ */
+int port_purge_page(port_t * port, void * addr, size_t size);
+
+/*
+ * Fault in the pages of [addr, addr + size) (page aligned) ahead of use,
+ * their contents are kept.
+ */
+int port_populate_page(port_t * port, void * addr, size_t size);
+
+/*
+ * Return a monotonic time in milliseconds
+ */
+size_t port_time_ms(void);
+
+/*
+ * Map memory outside of heap for allocator metadata (page granularity)
+ */
+void * port_map_meta(size_t size);
+
+/*
+ * Resize metadata mapped by port_map_meta, the mapping may move
+ */
+void * port_remap_meta(void * addr, size_t old_size, size_t new_size);
+
+/*
+ * Unmap metadata mapped by port_map_meta
+ */
+int port_unmap_meta(void * addr, size_t size);
+
+/*
+ * Use the file at path as heap, up to max_size bytes (file backend),
+ * DEFAULT_RESERVE_SIZE or RESERVE_SIZE_ENV bytes if max_size is 0
+ * 
+ * Must be called before the first extension. Return 1 if the file
+ * already contains a heap, 0 if the heap is empty, -1 on error.
+ */
+int port_open_file(port_t * port, const char * path, size_t max_size);
+
+/*
+ * Reserve max_size bytes of address space as heap (reserve backend),
+ * DEFAULT_RESERVE_SIZE or RESERVE_SIZE_ENV bytes if max_size is 0.
+ * 
+ * Must be called before the first extension.
+ */
+int port_open_reserve(port_t * port, size_t max_size);
+
+/*
+ * Release every page of the heap at once (file and reserve backend),
+ * a heap file is written back first.
+ * 
+ * The port is reset to a heap without backend.
+ */
+int port_close(port_t * port);
+
+/*
+ * Return the area of the heap file header kept for the memory manager
+ * (PAGE_SIZE - 256 bytes), or NULL if the heap is not file-backed.
+ */
+void * port_get_persist_area(port_t * port);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,54 @@
+/*
+ * This file defines the sampling heap profiler
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PROFILE_MAX_DEPTH   32      // Frames kept per allocation site
+#define PROFILE_SKIP_MAX    16      // Allocator frames skipped at most
+
+/*
+ * Functions on the path from a public allocation function down to 
+ * profile_sample are placed in this section. profile_sample skips the
+ * leading frames inside it, so a stack starts at the caller of the 
+ * allocator whatever the entry point (my_calloc, my_pool_alloc, ...).
+ */
+#define PROFILE_SECTION     __attribute__((section("mm_alloc_text")))
+
+/*
+ * Bytes left before the next sample, per thread.
+ * 
+ * my_malloc subtracts the size of every allocation, and only calls 
+ * profile_sample once it goes negative.
+ */
+extern __thread ssize_t profile_countdown;
+
+/*
+ * Record the allocation of size bytes at ptr with the current stack
+ * 
+ * Also draws the bytes until the next sample. Return 0 if ptr is a 
+ * sample, it must be passed to profile_retire when freed.
+ */
+PROFILE_SECTION int profile_sample(void * ptr, size_t size);
+
+/*
+ * Remove the sample at ptr from the live samples
+ */
+int profile_retire(void * ptr);
+
+/*
+ * Follow a sample moved from old_ptr to new_ptr (heap compaction)
+ */
+int profile_move(void * old_ptr, void * new_ptr);
+
+/*
+ * Remove every live sample in [start, end) (heap destroyed), return the
+ * number of samples removed
+ */
+size_t profile_retire_range(void * start, void * end);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * This file defines the binary event tracer behind the debug macros
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Tracing (make trace):
+ *
+ * With TRACE defined, debug / info / warn / success / error record an
+ * event into a ring buffer of the calling thread instead of printing:
+ *
+ * | tsc | site | arg 0 | ... | arg 5 |       64 bytes, no lock, no formatting
+ *
+ * The site is a static description of the call (level, file, function,
+ * line and format), one per macro call in the source. Arguments are
+ * stored as raw 64-bit words, so only integer and pointer arguments are
+ * supported (%s records the address of the string).
+ *
+ * Each ring keeps the last TRACE_RING_EVENTS events of its thread. Rings
+ * are written by my_trace_dump, or at exit to the file named by the
+ * MM_TRACE environment variable, and rendered by bin/trace_decode.
+ */
+#define TRACE_MAX_ARGS          6
+#define TRACE_RING_EVENTS       65536
+#define TRACE_MAGIC             "MMTRACE1"
+
+#define TRACE_DEBUG             0
+#define TRACE_INFO              1
+#define TRACE_WARN              2
+#define TRACE_SUCCESS           3
+#define TRACE_ERROR             4
+
+typedef struct trace_site {
+    uint32_t level;
+    uint32_t line;
+    uint32_t nargs;
+    const char * file;
+    const char * func;
+    const char * fmt;
+}trace_site_t;
+
+typedef struct trace_event {
+    uint64_t tsc;
+    uint64_t site;              // Address of the trace_site_t, the site id in dumps
+    uint64_t args[TRACE_MAX_ARGS];
+}trace_event_t;
+
+/*
+ * Dump Layout:
+ *
+ * header  | magic | ticks per us | site count | ring count |
+ * sites   | id | level | line | nargs | file len | func len | fmt len | strings | ...
+ * rings   | thread id | event count | events | ...
+ *
+ * Every field is a uint64_t (native byte order), strings are not
+ * terminated.
+ */
+
+#define TRACE_NARGS(...)        TRACE_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define TRACE_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+
+/*
+ * Each argument is converted to uint64_t at the call, trace_record reads
+ * every argument as a uint64_t whatever its type in the format.
+ */
+#define TRACE_CAT(a, b)         TRACE_CAT_(a, b)
+#define TRACE_CAT_(a, b)        a##b
+#define TRACE_WIDEN(...)        TRACE_CAT(TRACE_WIDEN_, TRACE_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define TRACE_WIDEN_0()
+#define TRACE_WIDEN_1(a)        , (uint64_t)(a)
+#define TRACE_WIDEN_2(a, ...)   , (uint64_t)(a) TRACE_WIDEN_1(__VA_ARGS__)
+#define TRACE_WIDEN_3(a, ...)   , (uint64_t)(a) TRACE_WIDEN_2(__VA_ARGS__)
+#define TRACE_WIDEN_4(a, ...)   , (uint64_t)(a) TRACE_WIDEN_3(__VA_ARGS__)
+#define TRACE_WIDEN_5(a, ...)   , (uint64_t)(a) TRACE_WIDEN_4(__VA_ARGS__)
+#define TRACE_WIDEN_6(a, ...)   , (uint64_t)(a) TRACE_WIDEN_5(__VA_ARGS__)
+#define TRACE_WIDEN_7(a, ...)   , (uint64_t)(a) TRACE_WIDEN_6(__VA_ARGS__)
+#define TRACE_WIDEN_8(a, ...)   , (uint64_t)(a) TRACE_WIDEN_7(__VA_ARGS__)
+
+#define trace(L, S, ...)                                                       \
+  do {                                                                         \
+    _Static_assert(TRACE_NARGS(__VA_ARGS__) <= TRACE_MAX_ARGS,                 \
+                   "Too many arguments to trace");                             \
+    static const trace_site_t _trace_site = {L, __LINE__,                      \
+        TRACE_NARGS(__VA_ARGS__), __FILE__, __extension__ __FUNCTION__, S};    \
+    trace_record(&_trace_site TRACE_WIDEN(__VA_ARGS__));                       \
+  } while (0)
+
+/*
+ * Record an event of site into the ring of the calling thread, the
+ * arguments are site->nargs uint64_t (see TRACE_WIDEN)
+ */
+void trace_record(const trace_site_t * site, ...);
+
+#endif
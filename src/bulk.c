@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bulk.h"
+#include "debug.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * The streaming kernels are selected once at runtime:
+ *
+ * 1. AVX2 if the CPU supports it, 32-byte stores.
+ * 2. SSE2 on every other x86-64 CPU, 16-byte stores.
+ * 3. memcpy / memset on other architectures, whatever the size.
+ *
+ * Streaming stores must be aligned, the head up to the alignment and the
+ * tail are written by memcpy / memset. Each iteration moves 128 bytes
+ * (2 lines), loads first. The source is left to the hardware prefetcher,
+ * prefetching it with the non-temporal hint was slower and evicted as 
+ * much. Streaming stores are weakly ordered, the sfence at the end 
+ * orders them before any later store (e.g. the header written after the
+ * block is zeroed).
+ */
+
+typedef struct bulk_kernels {
+    const char * name;
+    void (*copy)(void * dst, const void * src, size_t size);
+    void (*zero)(void * dst, size_t size);
+}bulk_kernels_t;
+
+static void copy_none(void * dst, const void * src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+static void zero_none(void * dst, size_t size) {
+    memset(dst, 0, size);
+}
+
+static const bulk_kernels_t none_kernels = {
+    "none", copy_none, zero_none
+};
+
+#if defined(__x86_64__)
+
+/*
+ * Bytes before the next align boundary of dst, at most size
+ */
+static size_t head_bytes(void * dst, size_t size, size_t align) {
+    size_t head = -(uintptr_t)dst & (align - 1);
+    return (head < size)?head:size;
+}
+
+/*
+ * SSE2 kernels (baseline of x86-64)
+ */
+static void copy_sse2(void * dst, const void * src, size_t size) {
+    size_t head = head_bytes(dst, size, 16);
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for(; size >= 128; size -= 128, dst += 128, src += 128) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)src);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)src + 1);
+        __m128i v2 = _mm_loadu_si128((const __m128i *)src + 2);
+        __m128i v3 = _mm_loadu_si128((const __m128i *)src + 3);
+        __m128i v4 = _mm_loadu_si128((const __m128i *)src + 4);
+        __m128i v5 = _mm_loadu_si128((const __m128i *)src + 5);
+        __m128i v6 = _mm_loadu_si128((const __m128i *)src + 6);
+        __m128i v7 = _mm_loadu_si128((const __m128i *)src + 7);
+        _mm_stream_si128((__m128i *)dst, v0);
+        _mm_stream_si128((__m128i *)dst + 1, v1);
+        _mm_stream_si128((__m128i *)dst + 2, v2);
+        _mm_stream_si128((__m128i *)dst + 3, v3);
+        _mm_stream_si128((__m128i *)dst + 4, v4);
+        _mm_stream_si128((__m128i *)dst + 5, v5);
+        _mm_stream_si128((__m128i *)dst + 6, v6);
+        _mm_stream_si128((__m128i *)dst + 7, v7);
+    }
+    _mm_sfence();
+
+    memcpy(dst, src, size);
+}
+
+static void zero_sse2(void * dst, size_t size) {
+    __m128i zero = _mm_setzero_si128();
+    size_t head = head_bytes(dst, size, 16);
+    memset(dst, 0, head);
+    dst += head;
+    size -= head;
+
+    for(; size >= 128; size -= 128, dst += 128) {
+        for(int i = 0; i < 8; i++) {
+            _mm_stream_si128((__m128i *)dst + i, zero);
+        }
+    }
+    _mm_sfence();
+
+    memset(dst, 0, size);
+}
+
+static const bulk_kernels_t sse2_kernels = {
+    "sse2", copy_sse2, zero_sse2
+};
+
+/*
+ * AVX2 kernels, compiled for AVX2 regardless of the build flags and only
+ * called if the CPU supports AVX2.
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void copy_avx2(void * dst, const void * src, size_t size) {
+    size_t head = head_bytes(dst, size, 32);
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for(; size >= 128; size -= 128, dst += 128, src += 128) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)src);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)src + 1);
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)src + 2);
+        __m256i v3 = _mm256_loadu_si256((const __m256i *)src + 3);
+        _mm256_stream_si256((__m256i *)dst, v0);
+        _mm256_stream_si256((__m256i *)dst + 1, v1);
+        _mm256_stream_si256((__m256i *)dst + 2, v2);
+        _mm256_stream_si256((__m256i *)dst + 3, v3);
+    }
+    _mm_sfence();
+
+    memcpy(dst, src, size);
+}
+
+AVX2 static void zero_avx2(void * dst, size_t size) {
+    __m256i zero = _mm256_setzero_si256();
+    size_t head = head_bytes(dst, size, 32);
+    memset(dst, 0, head);
+    dst += head;
+    size -= head;
+
+    for(; size >= 128; size -= 128, dst += 128) {
+        _mm256_stream_si256((__m256i *)dst, zero);
+        _mm256_stream_si256((__m256i *)dst + 1, zero);
+        _mm256_stream_si256((__m256i *)dst + 2, zero);
+        _mm256_stream_si256((__m256i *)dst + 3, zero);
+    }
+    _mm_sfence();
+
+    memset(dst, 0, size);
+}
+
+static const bulk_kernels_t avx2_kernels = {
+    "avx2", copy_avx2, zero_avx2
+};
+
+#endif
+
+static const bulk_kernels_t * kernels = NULL;
+static size_t threshold = 0;
+
+static const bulk_kernels_t * get_kernels(void) {
+    if(kernels != NULL) {
+        return kernels;
+    }
+
+    kernels = &none_kernels;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernels = &avx2_kernels;
+    }
+    else {
+        kernels = &sse2_kernels;
+    }
+#endif
+
+    info("Large blocks moved with %s streaming stores from %ld bytes", kernels->name, bulk_threshold());
+    return kernels;
+}
+
+/* ==================================================================================
+ * |                   Functions below are public interfaces                        |
+ * ==================================================================================
+ */
+
+/*
+ * Copy size bytes from src to dst (not overlapping)
+ */
+void bulk_copy(void * dst, const void * src, size_t size) {
+    if(size < bulk_threshold()) {
+        memcpy(dst, src, size);
+        return;
+    }
+    get_kernels()->copy(dst, src, size);
+}
+
+/*
+ * Zero size bytes at dst
+ */
+void bulk_zero(void * dst, size_t size) {
+    if(size < bulk_threshold()) {
+        memset(dst, 0, size);
+        return;
+    }
+    get_kernels()->zero(dst, size);
+}
+
+/*
+ * Return the size from which blocks are moved with streaming stores:
+ * BULK_ENV (bytes) if set and valid, otherwise the L2 cache size, at 
+ * least BULK_MIN_THRESHOLD.
+ */
+size_t bulk_threshold(void) {
+    if(threshold != 0) {
+        return threshold;
+    }
+
+    size_t size = BULK_DEFAULT_THRESHOLD;
+    long l2_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if(l2_size > 0) {
+        size = l2_size;
+    }
+    const char * env = getenv(BULK_ENV);
+    if(env != NULL) {
+        char * end;
+        errno = 0;
+        unsigned long long value = strtoull(env, &end, 0);
+
+        // Not a number, trailing garbage, negative (wrapped), 0 or too large
+        if(end == env || *end != '\0' || strchr(env, '-') != NULL || value == 0 || errno == ERANGE || value > SIZE_MAX) {
+            warn("Invalid %s=%s, streaming from %ld bytes", BULK_ENV, env, size);
+        }
+        else {
+            size = value;
+        }
+    }
+
+    threshold = (size < BULK_MIN_THRESHOLD)?BULK_MIN_THRESHOLD:size;
+    return threshold;
+}
+
+/*
+ * Name of the instruction set of streaming stores ("avx2", "sse2" or "none")
+ */
+const char * bulk_isa(void) {
+    return get_kernels()->name;
+}
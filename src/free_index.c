@@ -0,0 +1,579 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "debug.h"
+#include "free_index.h"
+#include "port.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * The scan kernels are selected once at runtime:
+ *
+ * 1. AVX2 if the CPU supports it, 8 keys per compare.
+ * 2. SSE2 on every other x86-64 CPU, 4 keys per compare.
+ * 3. Scalar loops on other architectures.
+ *
+ * Keys are unsigned, but SSE2 only compares signed 32-bit integers, so
+ * the SSE2 kernels flip the sign bit of both operands before comparing.
+ */
+
+typedef struct index_kernels {
+    const char * name;
+    size_t (*ge_forward)(const uint32_t * keys, size_t start, size_t count, uint32_t key);
+    ssize_t (*ge_backward)(const uint32_t * keys, size_t end, uint32_t key);
+    uint32_t (*min_ge)(const uint32_t * keys, size_t count, uint32_t key);
+    size_t (*eq_key)(const uint32_t * keys, size_t count, uint32_t key);
+}index_kernels_t;
+
+/*
+ * Scalar kernels
+ */
+static size_t ge_forward_scalar(const uint32_t * keys, size_t start, size_t count, uint32_t key) {
+    for(size_t i = start; i < count; i++) {
+        if(keys[i] >= key) {
+            return i;
+        }
+    }
+    return count;
+}
+
+static ssize_t ge_backward_scalar(const uint32_t * keys, size_t end, uint32_t key) {
+    for(ssize_t i = end - 1; i >= 0; i--) {
+        if(keys[i] >= key) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint32_t min_ge_scalar(const uint32_t * keys, size_t count, uint32_t key) {
+    uint32_t min = INDEX_KEY_MAX;
+    for(size_t i = 0; i < count; i++) {
+        if(keys[i] >= key && keys[i] < min) {
+            min = keys[i];
+            if(min == key) {
+                break;
+            }
+        }
+    }
+    return min;
+}
+
+static size_t eq_key_scalar(const uint32_t * keys, size_t count, uint32_t key) {
+    for(size_t i = 0; i < count; i++) {
+        if(keys[i] == key) {
+            return i;
+        }
+    }
+    return count;
+}
+
+static const index_kernels_t scalar_kernels = {
+    "scalar", ge_forward_scalar, ge_backward_scalar, min_ge_scalar, eq_key_scalar
+};
+
+#if defined(__x86_64__)
+
+/*
+ * SSE2 kernels (baseline of x86-64)
+ */
+#define SIGN_BIT ((int)0x80000000)
+
+static size_t ge_forward_sse2(const uint32_t * keys, size_t start, size_t count, uint32_t key) {
+    __m128i sign = _mm_set1_epi32(SIGN_BIT);
+    __m128i vkey = _mm_xor_si128(_mm_set1_epi32(key), sign);
+    size_t i = start;
+
+    for(; i + 4 <= count; i += 4) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + i)), sign);
+        // key > v means v does not fit
+        int mask = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vkey, v))) & 0xF;
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return ge_forward_scalar(keys, i, count, key);
+}
+
+static ssize_t ge_backward_sse2(const uint32_t * keys, size_t end, uint32_t key) {
+    __m128i sign = _mm_set1_epi32(SIGN_BIT);
+    __m128i vkey = _mm_xor_si128(_mm_set1_epi32(key), sign);
+    size_t i = end;
+
+    for(; i >= 4; i -= 4) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + i - 4)), sign);
+        int mask = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vkey, v))) & 0xF;
+        if(mask != 0) {
+            return i - 4 + (31 - __builtin_clz(mask));
+        }
+    }
+    return ge_backward_scalar(keys, i, key);
+}
+
+static uint32_t min_ge_sse2(const uint32_t * keys, size_t count, uint32_t key) {
+    __m128i sign = _mm_set1_epi32(SIGN_BIT);
+    __m128i vkey = _mm_xor_si128(_mm_set1_epi32(key), sign);
+    __m128i vmin = _mm_set1_epi32(INT32_MAX);           // INDEX_KEY_MAX with sign bit flipped
+    size_t i = 0;
+
+    for(; i + 4 <= count; i += 4) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + i)), sign);
+        if(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(vkey, v))) != 0) {
+            // Exact fit, no better candidate
+            return key;
+        }
+        // Keys that do not fit are replaced by the largest key
+        __m128i too_small = _mm_cmpgt_epi32(vkey, v);
+        v = _mm_or_si128(_mm_andnot_si128(too_small, v), _mm_and_si128(too_small, _mm_set1_epi32(INT32_MAX)));
+        __m128i smaller = _mm_cmpgt_epi32(vmin, v);
+        vmin = _mm_or_si128(_mm_and_si128(smaller, v), _mm_andnot_si128(smaller, vmin));
+    }
+
+    uint32_t lanes[4];
+    uint32_t min = INDEX_KEY_MAX;
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(vmin, sign));
+    for(int lane = 0; lane < 4; lane++) {
+        if(lanes[lane] < min) {
+            min = lanes[lane];
+        }
+    }
+
+    uint32_t tail = min_ge_scalar(keys + i, count - i, key);
+    return (tail < min)?tail:min;
+}
+
+static size_t eq_key_sse2(const uint32_t * keys, size_t count, uint32_t key) {
+    __m128i vkey = _mm_set1_epi32(key);
+    size_t i = 0;
+
+    for(; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(vkey, v)));
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + eq_key_scalar(keys + i, count - i, key);
+}
+
+static const index_kernels_t sse2_kernels = {
+    "sse2", ge_forward_sse2, ge_backward_sse2, min_ge_sse2, eq_key_sse2
+};
+
+/*
+ * AVX2 kernels, compiled for AVX2 regardless of the build flags and only
+ * called if the CPU supports AVX2.
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline int fit_mask_avx2(__m256i v, __m256i vkey) {
+    // v >= key <=> max(v, key) == v
+    __m256i fit = _mm256_cmpeq_epi32(_mm256_max_epu32(v, vkey), v);
+    return _mm256_movemask_ps(_mm256_castsi256_ps(fit));
+}
+
+AVX2 static size_t ge_forward_avx2(const uint32_t * keys, size_t start, size_t count, uint32_t key) {
+    __m256i vkey = _mm256_set1_epi32(key);
+    size_t i = start;
+
+    for(; i + 8 <= count; i += 8) {
+        int mask = fit_mask_avx2(_mm256_loadu_si256((const __m256i *)(keys + i)), vkey);
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return ge_forward_scalar(keys, i, count, key);
+}
+
+AVX2 static ssize_t ge_backward_avx2(const uint32_t * keys, size_t end, uint32_t key) {
+    __m256i vkey = _mm256_set1_epi32(key);
+    size_t i = end;
+
+    for(; i >= 8; i -= 8) {
+        int mask = fit_mask_avx2(_mm256_loadu_si256((const __m256i *)(keys + i - 8)), vkey);
+        if(mask != 0) {
+            return i - 8 + (31 - __builtin_clz(mask));
+        }
+    }
+    return ge_backward_scalar(keys, i, key);
+}
+
+AVX2 static uint32_t min_ge_avx2(const uint32_t * keys, size_t count, uint32_t key) {
+    __m256i vkey = _mm256_set1_epi32(key);
+    __m256i vmin = _mm256_set1_epi32(-1);
+    size_t i = 0;
+
+    for(; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+        if(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(vkey, v))) != 0) {
+            // Exact fit, no better candidate
+            return key;
+        }
+        // Keys that do not fit are replaced by the largest key
+        __m256i fit = _mm256_cmpeq_epi32(_mm256_max_epu32(v, vkey), v);
+        v = _mm256_or_si256(v, _mm256_xor_si256(fit, _mm256_set1_epi32(-1)));
+        vmin = _mm256_min_epu32(vmin, v);
+    }
+
+    __m128i half = _mm_min_epu32(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1));
+    half = _mm_min_epu32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_min_epu32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t min = _mm_cvtsi128_si32(half);
+
+    uint32_t tail = min_ge_scalar(keys + i, count - i, key);
+    return (tail < min)?tail:min;
+}
+
+AVX2 static size_t eq_key_avx2(const uint32_t * keys, size_t count, uint32_t key) {
+    __m256i vkey = _mm256_set1_epi32(key);
+    size_t i = 0;
+
+    for(; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(vkey, v)));
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + eq_key_scalar(keys + i, count - i, key);
+}
+
+static const index_kernels_t avx2_kernels = {
+    "avx2", ge_forward_avx2, ge_backward_avx2, min_ge_avx2, eq_key_avx2
+};
+
+#endif
+
+static const index_kernels_t * kernels = NULL;
+
+static const index_kernels_t * get_kernels(void) {
+    if(kernels != NULL) {
+        return kernels;
+    }
+
+    kernels = &scalar_kernels;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernels = &avx2_kernels;
+    }
+    else {
+        kernels = &sse2_kernels;
+    }
+#endif
+
+    info("Free index scanned with %s", kernels->name);
+    return kernels;
+}
+
+/*
+ * Offset Hash:
+ *
+ * slots | p0 + 1 | 0 | p1 + 1 | ... |      32-bit, position of an entry, 0 if empty
+ *
+ * Finds the position of a block from its offset, so that a delete does
+ * not scan the offsets. Linear probing, the table has twice as many 
+ * slots as the index has entries.
+ */
+#define INDEX_MAX_ENTRIES   ((size_t)UINT32_MAX/2)
+#define INDEX_COMPACT_MIN   64                      // Deleted entries kept before compacting
+
+static size_t hash_offset(size_t offset) {
+    size_t hash = (offset >> INDEX_KEY_SHIFT)*0x9e3779b97f4a7c15;
+    return hash ^ (hash >> 32);
+}
+
+static void add_slot(free_index_t * index, size_t pos) {
+    size_t mask = index->slot_capacity - 1;
+    size_t slot = hash_offset(index->offsets[pos]) & mask;
+
+    while(index->slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    index->slots[slot] = pos + 1;
+}
+
+/*
+ * Return the slot of the entry of offset, or slot_capacity if none
+ */
+static size_t find_slot(free_index_t * index, size_t offset) {
+    size_t mask = index->slot_capacity - 1;
+
+    if(index->slot_capacity == 0) {
+        return 0;
+    }
+    for(size_t slot = hash_offset(offset) & mask; index->slots[slot] != 0; slot = (slot + 1) & mask) {
+        if(index->offsets[index->slots[slot] - 1] == offset) {
+            return slot;
+        }
+    }
+    return index->slot_capacity;
+}
+
+/*
+ * Empty slot, moving back the following entries which could no longer be
+ * found past the hole (see delete_sample in profile.c).
+ */
+static void delete_slot(free_index_t * index, size_t slot) {
+    size_t mask = index->slot_capacity - 1;
+
+    for(;;) {
+        index->slots[slot] = 0;
+        size_t next = slot;
+        for(;;) {
+            next = (next + 1) & mask;
+            if(index->slots[next] == 0) {
+                return;
+            }
+            size_t home = hash_offset(index->offsets[index->slots[next] - 1]) & mask;
+            // Entry stays if its home slot is cyclically in (slot, next]
+            if((slot <= next)?(slot < home && home <= next):(slot < home || home <= next)) {
+                continue;
+            }
+            break;
+        }
+        index->slots[slot] = index->slots[next];
+        slot = next;
+    }
+}
+
+/*
+ * Drop the deleted entries, keeping the order of the others. Slots are
+ * updated in place: an entry only moves down to a position already 
+ * passed, so the offsets read by find_slot are still right.
+ */
+static void compact_index(free_index_t * index) {
+    size_t live = 0;
+    size_t rover = index->count;
+
+    for(size_t pos = 0; pos < index->count; pos++) {
+        if(pos == index->rover) {
+            rover = live;
+        }
+        if(index->keys[pos] == 0) {
+            continue;
+        }
+        if(live != pos) {
+            size_t slot = find_slot(index, index->offsets[pos]);
+            index->keys[live] = index->keys[pos];
+            index->offsets[live] = index->offsets[pos];
+            index->slots[slot] = live + 1;
+        }
+        live++;
+    }
+
+    index->rover = (rover == index->count)?live:rover;
+    index->count = live;
+    index->deleted = 0;
+}
+
+/*
+ * Double the capacity of index (or map the first page of keys)
+ *
+ * keys may move when remapped, it is stored as soon as it is remapped.
+ * If offsets then fails, keys is shrunk back so both arrays keep the
+ * capacity they are unmapped with. On the first map, keys is unmapped.
+ */
+static int grow_index(free_index_t * index) {
+    size_t capacity = index->capacity?(2*index->capacity):(PAGE_SIZE/sizeof(uint32_t));
+    if(capacity > INDEX_MAX_ENTRIES) {
+        error("Free index limited to %ld entries", INDEX_MAX_ENTRIES);
+        return -1;
+    }
+    uint32_t * keys;
+    size_t * offsets = NULL;
+
+    if(index->capacity == 0) {
+        keys = port_map_meta(capacity*sizeof(uint32_t));
+        if(keys != NULL) {
+            offsets = port_map_meta(capacity*sizeof(size_t));
+            if(offsets == NULL) {
+                port_unmap_meta(keys, capacity*sizeof(uint32_t));
+            }
+            else {
+                index->keys = keys;
+            }
+        }
+    }
+    else {
+        keys = port_remap_meta(index->keys, index->capacity*sizeof(uint32_t), capacity*sizeof(uint32_t));
+        if(keys != NULL) {
+            index->keys = keys;
+            offsets = port_remap_meta(index->offsets, index->capacity*sizeof(size_t), capacity*sizeof(size_t));
+            if(offsets == NULL) {
+                // Shrinking does not move the mapping
+                keys = port_remap_meta(index->keys, capacity*sizeof(uint32_t), index->capacity*sizeof(uint32_t));
+                index->keys = (keys != NULL)?keys:index->keys;
+            }
+        }
+    }
+
+    if(offsets == NULL) {
+        error("Unable to grow free index to %ld entries", capacity);
+        return -1;
+    }
+
+    index->offsets = offsets;
+    index->capacity = capacity;
+
+    // The hash is rebuilt in a table twice as large, which stays half full
+    uint32_t * slots = port_map_meta(2*capacity*sizeof(uint32_t));
+    if(slots == NULL) {
+        error("Unable to grow free index hash to %ld slots", 2*capacity);
+        return -1;
+    }
+    if(index->slot_capacity != 0) {
+        port_unmap_meta(index->slots, index->slot_capacity*sizeof(uint32_t));
+    }
+    index->slots = slots;
+    index->slot_capacity = 2*capacity;
+    for(size_t pos = 0; pos < index->count; pos++) {
+        if(index->keys[pos] != 0) {
+            add_slot(index, pos);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Return the key of a block of size bytes, rounded up
+ */
+uint32_t free_index_key(size_t size) {
+    size_t key = (size + (1 << INDEX_KEY_SHIFT) - 1) >> INDEX_KEY_SHIFT;
+    return (key >= INDEX_KEY_MAX)?INDEX_KEY_MAX:(uint32_t)key;
+}
+
+/*
+ * Add a free block to index
+ *
+ * An index that could not grow is marked out of sync and not maintained
+ * any more, the caller must fall back to walking the free list.
+ */
+int free_index_insert(free_index_t * index, size_t size, size_t offset) {
+    if(index->out_of_sync) {
+        return 0;
+    }
+
+    // Amortized: at least count / 2 deletes since the last compaction
+    if(index->deleted >= INDEX_COMPACT_MIN && 2*index->deleted >= index->count) {
+        compact_index(index);
+    }
+
+    if(index->count == index->capacity && grow_index(index) != 0) {
+        index->out_of_sync = 1;
+        return -1;
+    }
+
+    // Key rounded down, a block must never look larger than it is
+    index->keys[index->count] = ((size >> INDEX_KEY_SHIFT) >= INDEX_KEY_MAX)?INDEX_KEY_MAX:(size >> INDEX_KEY_SHIFT);
+    index->offsets[index->count] = offset;
+    add_slot(index, index->count);
+    index->count++;
+
+    return 0;
+}
+
+/*
+ * Remove a free block from index
+ *
+ * The entry is found by the offset hash and left in place with key 0,
+ * which never fits, so positions and order of the other entries do not
+ * change. Deleted entries at the end are dropped at once.
+ */
+int free_index_delete(free_index_t * index, size_t offset) {
+    if(index->out_of_sync) {
+        return -1;
+    }
+
+    size_t slot = find_slot(index, offset);
+    if(slot == index->slot_capacity) {
+        error("Block +%lx not in free index", offset);
+        index->out_of_sync = 1;
+        return -1;
+    }
+    size_t pos = index->slots[slot] - 1;
+    delete_slot(index, slot);
+
+    index->keys[pos] = 0;
+    index->deleted++;
+    while(index->count != 0 && index->keys[index->count - 1] == 0) {
+        index->count--;
+        index->deleted--;
+    }
+
+    return 0;
+}
+
+/*
+ * Return the position of the first entry (at or after start) whose key is
+ * not smaller than key, or -1 if none.
+ */
+ssize_t free_index_first_fit(free_index_t * index, uint32_t key, size_t start) {
+    if(start >= index->count) {
+        return -1;
+    }
+
+    size_t pos = get_kernels()->ge_forward(index->keys, start, index->count, key);
+    return (pos == index->count)?-1:(ssize_t)pos;
+}
+
+/*
+ * Return the position of the last entry (before end) whose key is not
+ * smaller than key, or -1 if none.
+ */
+ssize_t free_index_last_fit(free_index_t * index, uint32_t key, size_t end) {
+    if(end > index->count) {
+        end = index->count;
+    }
+
+    return get_kernels()->ge_backward(index->keys, end, key);
+}
+
+/*
+ * Return the position of the entry with the smallest key not smaller than
+ * key, or -1 if none.
+ *
+ * Two passes over keys: find the smallest fitting key, then its position.
+ * A saturated key could not be compared exactly, in which case the first
+ * fitting entry is returned and the caller must check the block size.
+ */
+ssize_t free_index_best_fit(free_index_t * index, uint32_t key) {
+    const index_kernels_t * k = get_kernels();
+
+    if(index->count == 0) {
+        return -1;
+    }
+
+    uint32_t min = k->min_ge(index->keys, index->count, key);
+    if(min == INDEX_KEY_MAX) {
+        return free_index_first_fit(index, key, 0);
+    }
+
+    return k->eq_key(index->keys, index->count, min);
+}
+
+/*
+ * Unmap the arrays of index
+ */
+void free_index_release(free_index_t * index) {
+    if(index->capacity != 0) {
+        port_unmap_meta(index->keys, index->capacity*sizeof(uint32_t));
+        port_unmap_meta(index->offsets, index->capacity*sizeof(size_t));
+    }
+    if(index->slot_capacity != 0) {
+        port_unmap_meta(index->slots, index->slot_capacity*sizeof(uint32_t));
+    }
+    memset(index, 0, sizeof(free_index_t));
+}
+
+/*
+ * Name of the instruction set used to scan indexes ("avx2", "sse2" or "scalar")
+ */
+const char * free_index_isa(void) {
+    return get_kernels()->name;
+}
@@ -35,5 +35,52 @@ int main(int argc, char * argv[]) {
         
     }
 
+    // Fixed-size objects
+    my_pool_t * pool = my_pool_create(48, 0);
+    if(pool == NULL)
+        return EXIT_FAILURE;
+
+    for(int i = 0; i < 1000; i++) {
+        test_addr[i] = my_pool_alloc(pool);
+        if(test_addr[i] == NULL)
+            return EXIT_FAILURE;
+    }
+    for(int i = 0; i < 1000; i++) {
+        my_pool_free(pool, test_addr[i]);
+    }
+
+    my_pool_stats_t pool_stats;
+    my_pool_stats(pool, &pool_stats);
+    printf("pool: %ld chunk(s), %ld slot(s), high water %ld byte(s)\n", pool_stats.chunk_count, pool_stats.slots_total, pool_stats.bytes_high_water);
+
+    my_pool_destroy(pool);
+
+    // Separate heap, released at once
+    mm_heap_t * heap = mm_heap_create(0);
+    if(heap == NULL)
+        return EXIT_FAILURE;
+
+    for(int i = 0; i < 1000; i++) {
+        test_addr[i] = mm_heap_malloc(heap, i*100);
+        if(test_addr[i] == NULL)
+            return EXIT_FAILURE;
+    }
+
+    // Deferred frees still queued when the heap is destroyed
+    for(int i = 0; i < 1000; i += 2) {
+        my_free_deferred(test_addr[i]);
+    }
+    mm_heap_destroy(heap);
+
+    void * deferred = my_malloc(64);
+    my_free_deferred(deferred);
+    my_free_drain();
+
+    my_deferred_stats_t deferred_stats;
+    my_deferred_stats(&deferred_stats);
+    printf("deferred: %ld freed, %ld failed\n", deferred_stats.reclaimed, deferred_stats.failed);
+    if(deferred_stats.failed != 0)
+        return EXIT_FAILURE;
+
     return EXIT_SUCCESS;
 }
\ No newline at end of file
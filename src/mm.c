@@ -3,10 +3,16 @@
 #include <stdint.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
+#include "bulk.h"
 #include "debug.h"
+#include "free_index.h"
 #include "mm.h"
 #include "port.h"
+#include "profile.h"
 
 /*
  * Memory Pool Map
@@ -43,7 +49,14 @@
  * |                  Value = Header XOR Magic Byte                   |     Block Footer
  * --------------------------------------------------------------------
  * 
+ * Allocate Flag bits:
+ * 
+ * bit 0: Allocated
+ * bit 1: Sampled by the heap profiler (see profile.c)
+ * bit 2: Movable, the contents start with the handle (see my_halloc)
  */
+#define SAMPLED_FLAG        0x2
+#define MOVABLE_FLAG        0x4
 
 /*
  * Unalloced Memory Map (actually should be freed memory map)
@@ -51,9 +64,9 @@
  * --------------------------------------------------------------------
  * | Block size (highest bit - bit 3) | Allocate Flag (bit 2 - bit 0) |     Block Header
  * -------------------------------------------------------------------- <- aligned
- * |  Previous Unalloced Block in FREE_LIST (Pointer to Block Header) |
+ * |   Previous Unalloced Block in FREE_LIST (Offset from Heap start) |
  * --------------------------------------------------------------------
- * |    Next Unalloced Block in FREE_LIST (Pointer to Block Header)   |
+ * |     Next Unalloced Block in FREE_LIST (Offset from Heap start)   |
  * -------------------------------------------------------------------- <- aligned
  * |                                                                  |
  * |                         Unused space                             |
@@ -64,14 +77,39 @@
  * 
  */
 
+/*
+ * Compact Layout (MM_COMPACT, make compact):
+ * 
+ * Headers, footers and free list links are 32-bit, contents are aligned
+ * to 8 bytes instead of 16, so the minimal block is 16 bytes in total 
+ * (8 bytes of tags, 8 bytes of contents for the links) instead of 32.
+ * The heap is limited to 4 GB so that sizes and offsets fit in 32 bits
+ * (see MAX_RESERVE_SIZE).
+ */
+#ifdef MM_COMPACT
+typedef uint32_t tag_t;
+typedef uint32_t link_t;
+#else
+typedef size_t tag_t;
+typedef size_t link_t;
+#endif
+
+#define BLK_ALIGN           MM_ALIGNMENT
+
 #define WORD_SIZE           (sizeof(size_t))
-#define SIZE_HorF           (sizeof(size_t))
+#define SIZE_HorF           (sizeof(tag_t))
+#define MIN_PAYLOAD         (2*sizeof(link_t))
 #define alignMask           (WORD_SIZE-1)
 #define actualBlkSize(size) (size + 2*SIZE_HorF)
-#define alignedSize(size)   ((size & ((alignMask<<1) + 1))?((size & ~((alignMask<<1) + 1)) + 2*WORD_SIZE):(size))
+#define alignedSize(size)   ((size & (BLK_ALIGN - 1))?((size & ~(BLK_ALIGN - 1)) + BLK_ALIGN):(size))
 #define nextBlock(ptr)      ((void *)*((size_t)(ptr+WORD_SIZE))
 #define requiredPage(size)  ((size%PAGE_SIZE)?(size/PAGE_SIZE + 1):(size/PAGE_SIZE))
 #define getBlkSize(ptr)     (ptr->header & ~alignMask)
+#define requestBlkSize(size) ((alignedSize(size) < MIN_PAYLOAD)?MIN_PAYLOAD:alignedSize(size))
+#define blkOffset(h, ptr)   ((size_t)((void *)(ptr) - port_get_mem_pool_start(&(h)->port)))
+#define offsetBlk(h, offset) ((mem_list_t *)(port_get_mem_pool_start(&(h)->port) + (offset)))
+#define linkBlk(h, link)    ((link)?offsetBlk(h, link):NULL)
+#define blkLink(h, ptr)     ((ptr)?blkOffset(h, ptr):0)
 
 /*
  * It's really tricky to define the struct like that, the reason is that the struct stored
@@ -79,19 +117,261 @@
  * in struct.
  * 
  * Define the list struct like this is the only solution.
+ * 
+ * The links are offsets from heap start (0 for none) instead of pointers,
+ * so the free lists are still valid if the heap is mapped at another 
+ * address (see my_persist_open).
  */
 typedef struct mem_list{
-    size_t prev_footer;
-    size_t header;
-    struct mem_list * prev;
-    struct mem_list * next;
+    tag_t prev_footer;
+    tag_t header;
+    link_t prev;
+    link_t next;
 }mem_list_t;
 
-static uint8_t flag_inited = 0;
-static mem_list_t * FREE_LIST[10] = {NULL};
+/*
+ * State of a file-backed heap, stored in the persist area of heap file.
+ * 
+ * The free list heads are only written by my_persist_close, the links
+ * inside the heap are offsets, so they stay valid after remapping.
+ */
+#ifdef MM_COMPACT
+#define PERSIST_MAGIC       ((size_t)0x54534953524550ac)  // Files of the other layout are rejected
+#else
+#define PERSIST_MAGIC       ((size_t)0x54534953524550ad)
+#endif
+
+typedef struct mm_persist {
+    size_t magic;
+    size_t clean;               // 1 if closed by my_persist_close
+    size_t free_list[10];       // Offsets of FREE_LIST heads
+    size_t root;                // Offset of root object
+}mm_persist_t;
+
+/*
+ * Purge State (free blocks of at least PURGE_MIN_SIZE)
+ * 
+ * -------------------------------------------------------------------- <- mem_list_t
+ * |  Footer of previous block | Header | Prev link | Next link       |
+ * -------------------------------------------------------------------- <- purge_state_t
+ * |  Time freed  |  Start of purged range  |  End of purged range    |
+ * --------------------------------------------------------------------
+ * |                    Interior (whole pages)                        |
+ * --------------------------------------------------------------------
+ * |                            Footer                                |
+ * --------------------------------------------------------------------
+ * 
+ * Once a block has been free for purge_decay ms, the pages of its
+ * interior are released to the system (port_purge_page), a block reused
+ * quickly keeps its pages. Fresh pages from heap extension are purged
+ * pages as well.
+ * 
+ * The purged range (heap offsets) reads as zero, so my_malloc does not
+ * zero it again, and the pages are not faulted until the application
+ * touches them.
+ */
+#define PURGE_MIN_SIZE      ((size_t)64*1024)   // Smaller free blocks keep their pages
+#define PURGE_DEFAULT_DECAY 1000                // ms a block stays free before purged
+#define PURGE_TICK          256                 // Calls between two checks of the time
+#define PURGE_THREAD_MIN_INTERVAL 10            // ms, shortest sleep of purge thread
+
+typedef struct purge_state {
+    size_t freed_at;            // port_time_ms() when the block was freed
+    size_t purged_start;
+    size_t purged_end;
+}purge_state_t;
+
+#define purgeState(ptr)     (((((mem_list_t *)(ptr))->header & ~alignMask) >= PURGE_MIN_SIZE)?(purge_state_t *)((void *)(ptr) + sizeof(mem_list_t)):NULL)
+
+/*
+ * Movable Block (allocated by my_halloc)
+ * 
+ * -------------------------------------------------------------------- 
+ * |                          Block Header                            |
+ * -------------------------------------------------------------------- <- aligned
+ * |                 Handle                 |         padding         |
+ * -------------------------------------------------------------------- <- my_hlock returns
+ * |                            Contents                              |
+ * --------------------------------------------------------------------
+ * |                          Block Footer                            |
+ * --------------------------------------------------------------------
+ * 
+ * The application only keeps the handle, and gets the address of the
+ * contents from the handle table while it holds a lock on the handle.
+ * Unlocked movable blocks are moved by the compactor, which finds the 
+ * handle to update from the block.
+ */
+#define HANDLE_PREFIX       (2*sizeof(size_t))
+
+typedef struct handle_entry {
+    void * ptr;                 // Contents, NULL if the entry is free
+    size_t locks;               // Lock count, the block is not moved if not 0
+    size_t next_free;           // Next free entry + 1 (free entry)
+}handle_entry_t;
+
+/*
+ * Memory Budget:
+ * 
+ * An extension which would take the heap past the soft limit (the hard
+ * limit if no soft limit) is held back and the pressure is relieved in 
+ * stages, searching the free lists again after each one:
+ * 
+ * 1. Free the deferred blocks, compact movable blocks and purge free 
+ *    blocks (internal reclamation).
+ * 2. Call the reclaim callbacks one by one, the heap unlocked, so the 
+ *    application could free cached blocks.
+ * 3. Extend the heap past the soft limit, up to the hard limit.
+ * 
+ * Compaction starts with a budget of the bytes requested and doubles it
+ * until a block fits or the pass reaches the end of heap, so a small
+ * request does not pay for moving the whole heap. The purge respects the
+ * decay, blocks freed recently are left committed.
+ * 
+ * Stages are run once per crossing of the soft limit: while the heap is
+ * already past it, later extensions go straight to stage 3, unless
+ * BUDGET_RELIEF_INTERVAL ms passed or the heap grew by 1/BUDGET_RELIEF_SLICE 
+ * of the soft limit since the last relief. Extensions held back by the 
+ * hard limit are always relieved.
+ * 
+ * Allocations made by the callbacks themselves are not relieved again.
+ */
+#define BUDGET_NORMAL       0
+#define BUDGET_PRESSURE     1           // Relieving, the soft limit holds
+#define BUDGET_OVER_SOFT    2           // Relieved, extend up to the hard limit
+
+#define BUDGET_RELIEF_INTERVAL  100     // ms
+#define BUDGET_RELIEF_SLICE     8
+
+typedef struct reclaim_entry {
+    my_reclaim_t fn;
+    void * arg;
+}reclaim_entry_t;
+
+/*
+ * Heap State
+ * 
+ * Everything about one heap, the memory pool (port) included. Heaps are
+ * linked in heap_list so my_free could find the heap owning a block.
+ * 
+ * The default heap serves the my_* functions, it reserves its address
+ * space on the first allocation.
+ */
+struct mm_heap {
+    port_t port;
+    uint8_t flag_inited;
+    mem_list_t * free_list[10];
+    free_index_t free_index[10];
+    mm_persist_t * persist;     // Not NULL if the heap is file-backed
+    int policy;                 // MM_POLICY_*, from MM_POLICY_ENV if negative
+    my_policy_stats_t policy_stats;
+    handle_entry_t * handles;   // Handle table (meta memory), entry i is handle i + 1
+    size_t handle_count;
+    size_t handle_capacity;
+    size_t handle_free;         // First free entry + 1, 0 if none
+    size_t compact_cursor;      // Offset of the next block to compact, 0 for first block
+    size_t budget_soft;         // Bytes of heap, 0 if unlimited
+    size_t budget_hard;
+    int budget_state;           // BUDGET_*
+    int budget_short;           // Set if the last extension was held back by the budget
+    reclaim_entry_t reclaims[MM_MAX_RECLAIMS];
+    size_t reclaim_count;
+    my_budget_stats_t budget_stats;
+    size_t relief_time;         // Time of the last relief, 0 if none
+    size_t relief_size;         // Heap size after the last relief
+    long purge_decay;           // ms before a free block is purged, never if negative
+    size_t next_purge;          // Time of the next purge pass
+    unsigned int purge_tick;    // Calls left before checking the time
+    pthread_mutex_t lock;       // Held by public functions while background threads run
+    void * lock_owner;          // lock_token of the thread holding lock
+    struct mm_heap * next;
+};
+
+#define HEAP_INITIALIZER {.port = PORT_INITIALIZER, .policy = -1, .purge_decay = PURGE_DEFAULT_DECAY, .lock = PTHREAD_MUTEX_INITIALIZER}
+
+static mm_heap_t default_heap = HEAP_INITIALIZER;
+static mm_heap_t * heap_list = &default_heap;
+
+/*
+ * Background threads (see my_purge_thread) work on every heap in 
+ * heap_list. Heaps are only locked while such a thread runs, so that 
+ * single-threaded use pays nothing for it.
+ *
+ * background_threads may change between heapLock and heapUnlock, so
+ * heapUnlock does not read it again: the thread holding the lock of a
+ * heap stores the address of its lock_token in lock_owner, and only
+ * that thread finds its own token there and unlocks.
+ */
+static pthread_mutex_t heap_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static int background_threads = 0;
+
+/*
+ * my_free finds the heap of a pointer without heap_list_lock (see 
+ * heap_lookup): the default heap, never destroyed, is checked first.
+ * Other heaps are looked up with heap_list_readers raised until the 
+ * heap is no longer used, and mm_heap_destroy waits for the readers to
+ * leave once the heap is unlinked, before unmapping it.
+ */
+static size_t heap_list_readers = 0;
+static __thread char lock_token;
+
+#define heapLock(h)         do { \
+                                if(__atomic_load_n(&background_threads, __ATOMIC_ACQUIRE)) { \
+                                    pthread_mutex_lock(&(h)->lock); \
+                                    __atomic_store_n(&(h)->lock_owner, &lock_token, __ATOMIC_RELAXED); \
+                                } \
+                            } while(0)
+#define heapUnlock(h)       do { \
+                                if(__atomic_load_n(&(h)->lock_owner, __ATOMIC_RELAXED) == &lock_token) { \
+                                    __atomic_store_n(&(h)->lock_owner, NULL, __ATOMIC_RELAXED); \
+                                    pthread_mutex_unlock(&(h)->lock); \
+                                } \
+                            } while(0)
+
+static pthread_t purge_thread;
+static pthread_mutex_t purge_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t purge_thread_cond = PTHREAD_COND_INITIALIZER;
+static int purge_thread_running = 0;     // Also read without purge_thread_lock
+
+/*
+ * Deferred Free Queue:
+ * 
+ * my_free_deferred pushes the block onto a lock-free stack (Treiber 
+ * stack), the link is stored in the first word of the content, which
+ * fits the minimal block of both layouts. The reclaimer thread (or 
+ * my_free_drain) takes the whole stack at once with an atomic exchange,
+ * so entries are never popped one by one and the stack is free of ABA
+ * problems.
+ * 
+ * The block pushed onto an empty stack is the oldest of the next drain,
+ * its push records the time in deferred_since for the lag.
+ */
+#define DEFERRED_FREE_INTERVAL  10          // ms, sleep of reclaimer thread
+#define DEFERRED_FREE_BATCH     1024        // Depth waking the reclaimer thread early
+
+typedef struct deferred_free {
+    struct deferred_free * next;
+}deferred_free_t;
+
+static deferred_free_t * deferred_head = NULL;
+static size_t deferred_since = 0;
+static size_t deferred_depth = 0;
+static my_deferred_stats_t deferred_stats;
+static pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;     // Serializes drains
+
+static pthread_t reclaim_thread;
+static pthread_mutex_t reclaim_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_thread_cond = PTHREAD_COND_INITIALIZER;
+static int reclaim_thread_running = 0;   // Also read without reclaim_thread_lock
+
+/*
+ * Heaps of my_malloc_hint, created on first use. MM_LONG_LIVED uses the
+ * default heap.
+ */
+static mm_heap_t * lifetime_heaps[MM_LIFETIME_COUNT];
+static pthread_mutex_t lifetime_lock = PTHREAD_MUTEX_INITIALIZER;
 
-size_t magic_byte(void) {
-    return (size_t)0x1122334455667788;
+tag_t magic_byte(void) {
+    return (tag_t)0x1122334455667788;
 }
 
 static int determine_free_list_idx(size_t size) {
@@ -127,35 +407,35 @@ static int determine_free_list_idx(size_t size) {
     }
 }
 
-static int determine_free_list(size_t size) {
-    if(size <= 512 && (FREE_LIST[0] != NULL)) {
+static int determine_free_list(mm_heap_t * h, size_t size) {
+    if(size <= 512 && (h->free_list[0] != NULL)) {
         return 0;
     }
-    else if(size <= 1*1024*1024 && (FREE_LIST[1] != NULL)) {
+    else if(size <= 1*1024*1024 && (h->free_list[1] != NULL)) {
         return 1;
     }
-    else if(size <= 2*1024*1024 && (FREE_LIST[2] != NULL)) {
+    else if(size <= 2*1024*1024 && (h->free_list[2] != NULL)) {
         return 2;
     }
-    else if(size <= 4*1024*1024 && (FREE_LIST[3] != NULL)) {
+    else if(size <= 4*1024*1024 && (h->free_list[3] != NULL)) {
         return 3;
     }
-    else if(size <= 8*1024*1024 && (FREE_LIST[4] != NULL)) {
+    else if(size <= 8*1024*1024 && (h->free_list[4] != NULL)) {
         return 4;
     }
-    else if(size <= 16*1024*1024 && (FREE_LIST[5] != NULL)) {
+    else if(size <= 16*1024*1024 && (h->free_list[5] != NULL)) {
         return 5;
     }
-    else if(size <= 32*1024*1024 && (FREE_LIST[6] != NULL)) {
+    else if(size <= 32*1024*1024 && (h->free_list[6] != NULL)) {
         return 6;
     }
-    else if(size <= 64*1024*1024 && (FREE_LIST[7] != NULL)) {
+    else if(size <= 64*1024*1024 && (h->free_list[7] != NULL)) {
         return 7;
     }
-    else if(size <= 128*1024*1024 && (FREE_LIST[8] != NULL)) {
+    else if(size <= 128*1024*1024 && (h->free_list[8] != NULL)) {
         return 8;
     }
-    else if((FREE_LIST[9] != NULL)){
+    else if((h->free_list[9] != NULL)){
         return 9;
     }
     else {
@@ -163,8 +443,172 @@ static int determine_free_list(size_t size) {
     }
 }
 
-static mem_list_t * find_block_in_list(int list_idx, size_t size) {
-    mem_list_t * ptr = FREE_LIST[list_idx];
+/*
+ * Placement Policies
+ * 
+ * Every policy searches the free index of the list for the request size,
+ * then the lists of larger blocks (see find_required_block):
+ * 
+ * MM_POLICY_SEGREGATED: newest fitting block of h->free_list[0] (LIFO),
+ *                       best fit in sorted lists.
+ * MM_POLICY_FIRST_FIT:  fitting block at the lowest address.
+ * MM_POLICY_NEXT_FIT:   first fitting entry from the roving position,
+ *                       which is left after the block found.
+ * MM_POLICY_BEST_FIT:   smallest fitting block.
+ * MM_POLICY_GOOD_FIT:   from the roving position, at most GOOD_FIT_PROBES
+ *                       fitting blocks are examined. The first one 
+ *                       wasting at most 1/GOOD_FIT_SLACK of the request is
+ *                       taken, otherwise the smallest of them.
+ * 
+ * The roving position is a position in the free index, not an address,
+ * entries are in the order blocks were freed. It is kept in the index,
+ * which moves it down with the entries when deleted ones are dropped.
+ */
+#define GOOD_FIT_PROBES     8
+#define GOOD_FIT_SLACK      8
+#define POLICY_ENV          "MM_POLICY"
+
+static const char * policy_names[MM_POLICY_COUNT] = {
+    "segregated", "first-fit", "next-fit", "best-fit", "good-fit"
+};
+
+/*
+ * Choose the policy of a heap not set by mm_heap_set_policy, from 
+ * POLICY_ENV (a name of policy_names)
+ */
+static void resolve_policy(mm_heap_t * h) {
+    if(h->policy >= 0) {
+        return;
+    }
+
+    h->policy = MM_POLICY_SEGREGATED;
+    const char * env = getenv(POLICY_ENV);
+    if(env == NULL) {
+        return;
+    }
+    for(int i = 0; i < MM_POLICY_COUNT; i++) {
+        if(strcmp(env, policy_names[i]) == 0) {
+            h->policy = i;
+            return;
+        }
+    }
+    warn("Unknown %s=%s, using %s", POLICY_ENV, env, policy_names[h->policy]);
+}
+
+static ssize_t index_lowest_fit(free_index_t * index, uint32_t key) {
+    ssize_t found = -1;
+
+    for(ssize_t pos = free_index_first_fit(index, key, 0); pos >= 0; pos = free_index_first_fit(index, key, pos + 1)) {
+        if(found < 0 || index->offsets[pos] < index->offsets[found]) {
+            found = pos;
+        }
+    }
+    return found;
+}
+
+static ssize_t index_next_fit(mm_heap_t * h, int list_idx, uint32_t key) {
+    free_index_t * index = &h->free_index[list_idx];
+    size_t start = (index->rover < index->count)?index->rover:0;
+
+    ssize_t pos = free_index_first_fit(index, key, start);
+    if(pos < 0 && start > 0) {
+        // Wrap around
+        pos = free_index_first_fit(index, key, 0);
+    }
+    if(pos >= 0) {
+        index->rover = pos + 1;
+    }
+    return pos;
+}
+
+static ssize_t index_good_fit(mm_heap_t * h, int list_idx, uint32_t key) {
+    free_index_t * index = &h->free_index[list_idx];
+    size_t start = (index->rover < index->count)?index->rover:0;
+    uint64_t good = (uint64_t)key + key/GOOD_FIT_SLACK;
+    ssize_t found = -1;
+    int probes = 0;
+
+    // [start, count), then [0, start)
+    for(int pass = 0; pass < 2 && probes < GOOD_FIT_PROBES; pass++) {
+        size_t end = (pass == 0)?index->count:start;
+        ssize_t pos = free_index_first_fit(index, key, (pass == 0)?start:0);
+
+        while(pos >= 0 && (size_t)pos < end && probes < GOOD_FIT_PROBES) {
+            probes++;
+            if(found < 0 || index->keys[pos] < index->keys[found]) {
+                found = pos;
+            }
+            if(index->keys[found] <= good) {
+                probes = GOOD_FIT_PROBES;
+                break;
+            }
+            pos = free_index_first_fit(index, key, pos + 1);
+        }
+    }
+
+    if(found >= 0) {
+        index->rover = found + 1;
+    }
+    return found;
+}
+
+/*
+ * Find a fitting block with the free index of the list, following the
+ * placement policy of the heap.
+ * 
+ * Return NULL if no block fits.
+ */
+static mem_list_t * find_block_in_index(mm_heap_t * h, int list_idx, size_t size) {
+    free_index_t * index = &h->free_index[list_idx];
+    uint32_t key = free_index_key(size);
+    ssize_t pos;
+
+    switch(h->policy) {
+        case MM_POLICY_FIRST_FIT:
+            pos = index_lowest_fit(index, key);
+            break;
+        case MM_POLICY_NEXT_FIT:
+            pos = index_next_fit(h, list_idx, key);
+            break;
+        case MM_POLICY_BEST_FIT:
+            pos = free_index_best_fit(index, key);
+            break;
+        case MM_POLICY_GOOD_FIT:
+            pos = index_good_fit(h, list_idx, key);
+            break;
+        default:
+            // h->free_list[0] is LIFO, sorted lists are searched for the best fit
+            if(list_idx == 0) {
+                pos = free_index_last_fit(index, key, index->count);
+            }
+            else {
+                pos = free_index_best_fit(index, key);
+            }
+            break;
+    }
+
+    if(pos < 0) {
+        return NULL;
+    }
+
+    return offsetBlk(h, index->offsets[pos]);
+}
+
+static mem_list_t * find_block_in_list(mm_heap_t * h, int list_idx, size_t size) {
+    mem_list_t * ptr = h->free_list[list_idx];
+
+    if(!h->free_index[list_idx].out_of_sync) {
+        ptr = find_block_in_index(h, list_idx, size);
+        // Saturated keys (huge blocks) could not be compared exactly
+        if(ptr == NULL || getBlkSize(ptr) >= size) {
+            if(ptr != NULL && (ptr->header & alignMask) != 0) {
+                error("Free List corrupted!");
+                return NULL;
+            }
+            return ptr;
+        }
+        ptr = h->free_list[list_idx];
+    }
 
     while(ptr != NULL) {
         if(getBlkSize(ptr) >= size) {
@@ -175,7 +619,7 @@ static mem_list_t * find_block_in_list(int list_idx, size_t size) {
             return ptr;
         }
 
-        ptr = ptr->next;
+        ptr = linkBlk(h, ptr->next);
     }
 
     return NULL;
@@ -184,41 +628,41 @@ static mem_list_t * find_block_in_list(int list_idx, size_t size) {
 /*
  * 
  */
-static void list_operation_insert_node(mem_list_t * list_node, mem_list_t * target) {
-    if(list_node->prev == NULL) {
+static void list_operation_insert_node(mm_heap_t * h, mem_list_t * list_node, mem_list_t * target) {
+    if(list_node->prev == 0) {
         // Insert to header
-        target->next = list_node;
-        target->prev = NULL;
-        list_node->prev = target;
+        target->next = blkLink(h, list_node);
+        target->prev = 0;
+        list_node->prev = blkLink(h, target);
     }
     else {
-        target->next = list_node;
+        target->next = blkLink(h, list_node);
         target->prev = list_node->prev;
-        list_node->prev->next = target;
-        list_node->prev = target;
+        linkBlk(h, list_node->prev)->next = blkLink(h, target);
+        list_node->prev = blkLink(h, target);
     }
 }
 
 /*
  * 
  */
-static void list_operation_delete_node(mem_list_t * list_node) {
-    if(list_node->next == NULL) {
+static void list_operation_delete_node(mm_heap_t * h, mem_list_t * list_node) {
+    if(list_node->next == 0) {
         // Delete Footer
-        list_node->prev->next = NULL;
-        list_node->prev = NULL;
-        list_node->next = NULL;
+        linkBlk(h, list_node->prev)->next = 0;
+        list_node->prev = 0;
+        list_node->next = 0;
     }
-    else if(list_node->prev == NULL) {
-        list_node->next->prev = NULL;
-        list_node->prev = NULL;
-        list_node->next = NULL;
+    else if(list_node->prev == 0) {
+        linkBlk(h, list_node->next)->prev = 0;
+        list_node->prev = 0;
+        list_node->next = 0;
     }
     else {
-        list_node->prev->next = list_node->next;
-        list_node->next->prev = list_node->prev;
-        list_node->prev = NULL;
-        list_node->next = NULL;
+        linkBlk(h, list_node->prev)->next = list_node->next;
+        linkBlk(h, list_node->next)->prev = list_node->prev;
+        list_node->prev = 0;
+        list_node->next = 0;
     }
 }
 
@@ -227,8 +671,8 @@ static void list_operation_delete_node(mem_list_t * list_node) {
  */
 static int check_blk(mem_list_t * blk) {
     size_t size = getBlkSize(blk);
-    size_t header = blk->header;
-    size_t footer = *(size_t *)((void *)blk + size + 2*SIZE_HorF);
+    tag_t header = blk->header;
+    tag_t footer = *(tag_t *)((void *)blk + size + 2*SIZE_HorF);
 
     if(header == (footer ^ magic_byte())) {
         // Pass
@@ -243,50 +687,57 @@ static int check_blk(mem_list_t * blk) {
 /*
  * Insert block into free list
  */
-static int insert_blk(mem_list_t * blk) {
+static int insert_blk(mm_heap_t * h, mem_list_t * blk) {
     size_t size = blk->header & ~alignMask;
-    mem_list_t * list = FREE_LIST[determine_free_list_idx(size)];
+    mem_list_t * list = h->free_list[determine_free_list_idx(size)];
 
     debug("Inserting blk_addr=%p, size=%lu", blk, size);
 
     if(check_blk(blk) != 0) {
-        error("Block corrupted, header=%lx@%p, footer=header=%lx@%p", blk->header, &blk->header, *(size_t *)((void *)blk + getBlkSize(blk) + 2*SIZE_HorF), (void *)blk + getBlkSize(blk) + 2*SIZE_HorF);
+        error("Block corrupted, header=%lx@%p, footer=header=%lx@%p", (size_t)blk->header, &blk->header, (size_t)*(tag_t *)((void *)blk + getBlkSize(blk) + 2*SIZE_HorF), (void *)blk + getBlkSize(blk) + 2*SIZE_HorF);
         return -1;
     }
 
+    // Out of sync index is ignored by find_block_in_list, block is still listed
+    free_index_insert(&h->free_index[determine_free_list_idx(size)], size, blkOffset(h, blk));
+
     if(determine_free_list_idx(size) == 0) {
         // FIFO policy
-        FREE_LIST[0] = blk;
-        blk->prev = NULL;
-        blk->next = list;
+        h->free_list[0] = blk;
+        blk->prev = 0;
+        blk->next = blkLink(h, list);
         if(list)
-            list->prev = blk;
+            list->prev = blkLink(h, blk);
     }
     else {
         // Best-Fit policy
         if(list == NULL) {
-            FREE_LIST[determine_free_list_idx(size)] = blk;
-            blk->prev = NULL;
-            blk->next = NULL;
+            h->free_list[determine_free_list_idx(size)] = blk;
+            blk->prev = 0;
+            blk->next = 0;
 
             return 0;
         }
 
-        while(list->next != NULL) {
+        while(list->next != 0) {
             if(getBlkSize(blk) >= getBlkSize(list)) {
-                list_operation_insert_node(list->next, blk);
+                list_operation_insert_node(h, linkBlk(h, list->next), blk);
                 return 0;
             }
-            list = list->next;
+            list = linkBlk(h, list->next);
         }
 
         if(getBlkSize(blk) >= getBlkSize(list)) {
-            list->next = blk;
-            blk->prev = list;
-            blk->next = NULL;
+            list->next = blkLink(h, blk);
+            blk->prev = blkLink(h, list);
+            blk->next = 0;
         }
         else {
-            list_operation_insert_node(list, blk);
+            list_operation_insert_node(h, list, blk);
+            if(blk->prev == 0) {
+                // Inserted before the only block of list
+                h->free_list[determine_free_list_idx(size)] = blk;
+            }
         }
     }
 
@@ -296,30 +747,101 @@ static int insert_blk(mem_list_t * blk) {
 /*
  * Delect block in free list
  */
-static int delete_block(mem_list_t * blk) {
+static int delete_block(mm_heap_t * h, mem_list_t * blk) {
     size_t size = blk->header & ~alignMask;
-    mem_list_t * list = FREE_LIST[determine_free_list_idx(size)];
+    mem_list_t * list = h->free_list[determine_free_list_idx(size)];
 
     if(check_blk(blk) != 0) {
         error("List corrupted");
         return -1;
     }
 
+    int list_idx = determine_free_list_idx(size);
+    free_index_delete(&h->free_index[list_idx], blkOffset(h, blk));
+
     if(list == blk) {
-        FREE_LIST[determine_free_list_idx(size)] = blk->next;
-        if(blk->next != NULL) {
-            blk->next->prev = NULL;
+        h->free_list[determine_free_list_idx(size)] = linkBlk(h, blk->next);
+        if(blk->next != 0) {
+            linkBlk(h, blk->next)->prev = 0;
         }
-        blk->prev = NULL;
-        blk->next = NULL;
+        blk->prev = 0;
+        blk->next = 0;
         return 0;
     }
 
-    list_operation_delete_node(blk);
+    list_operation_delete_node(h, blk);
 
     return 0;
 }
 
+/*
+ * Start the purge state of a free block from the state of the block(s)
+ * it was made of: freed at from->freed_at (now if 0), with the part of
+ * the purged range inside its interior still purged.
+ */
+static void purge_state_init(mm_heap_t * h, mem_list_t * blk, purge_state_t * from) {
+    purge_state_t * state = purgeState(blk);
+    size_t start = from->purged_start;
+    size_t end = from->purged_end;
+    if(state == NULL) {
+        return;
+    }
+
+    size_t first = blkOffset(h, blk) + sizeof(mem_list_t) + sizeof(purge_state_t);
+    size_t last = blkOffset(h, blk) + getBlkSize(blk) + 2*SIZE_HorF;
+    if(start < first) {
+        start = first;
+    }
+    if(end > last) {
+        end = last;
+    }
+
+    state->freed_at = (from->freed_at != 0)?from->freed_at:port_time_ms();
+    state->purged_start = (start < end)?start:0;
+    state->purged_end = (start < end)?end:0;
+}
+
+/*
+ * Merge the purge state of blk into purged when coalescing: keep the 
+ * larger purged range, and the time the largest block (largest bytes)
+ * was freed, so that freeing a small block next to a large one does not
+ * restart the decay of the large one.
+ */
+static void purge_state_merge(purge_state_t * purged, size_t * largest, mem_list_t * blk) {
+    purge_state_t * state = purgeState(blk);
+    if(state == NULL) {
+        return;
+    }
+
+    if(state->purged_end - state->purged_start > purged->purged_end - purged->purged_start) {
+        purged->purged_start = state->purged_start;
+        purged->purged_end = state->purged_end;
+    }
+    if(getBlkSize(blk) > *largest) {
+        *largest = getBlkSize(blk);
+        purged->freed_at = state->freed_at;
+    }
+}
+
+/*
+ * Zero size bytes of payload, except the purged range which reads as zero
+ */
+static void zero_payload(mm_heap_t * h, void * payload, size_t size, size_t purged_start, size_t purged_end) {
+    void * start = port_get_mem_pool_start(&h->port) + purged_start;
+    void * end = port_get_mem_pool_start(&h->port) + purged_end;
+
+    if(purged_start >= purged_end || end <= payload || start >= payload + size) {
+        bulk_zero(payload, size);
+        return;
+    }
+    if(start > payload) {
+        bulk_zero(payload, start - payload);
+    }
+    if(end < payload + size) {
+        bulk_zero(end, payload + size - end);
+    }
+}
+
 /*
  * Check if the remaining space greater than minimal block size
  * 
@@ -327,21 +849,27 @@ static int delete_block(mem_list_t * blk) {
  * 
  * If not, do nothing.
  */
-static int split_blk_if_necessary(mem_list_t * blk, size_t requested_size) {
+static int split_blk_if_necessary(mm_heap_t * h, mem_list_t * blk, size_t requested_size) {
     size_t size = getBlkSize(blk);
+    purge_state_t purged = {0, 0, 0};
     
     if(check_blk(blk) != 0) {
         error("Context corrupted");
         return -1;
     }
 
+    // The remaining block keeps the purge state, read it before overwritten
+    if(purgeState(blk) != NULL) {
+        purged = *purgeState(blk);
+    }
+
     size_t new_blk_size = size - requested_size;
 
-    if(new_blk_size >= 2*sizeof(size_t)+2*SIZE_HorF) {
+    if(new_blk_size >= MIN_PAYLOAD+2*SIZE_HorF) {
         new_blk_size = new_blk_size - 2*SIZE_HorF;
         debug("Spliting %ld into %ld and %ld", size+2*SIZE_HorF, requested_size+2*SIZE_HorF, new_blk_size+2*SIZE_HorF);
-        if(new_blk_size%(2*WORD_SIZE) != 0) {
-            error("**Unaligned, %ld mod %ld = %ld", new_blk_size, 2*WORD_SIZE, new_blk_size%(2*WORD_SIZE));
+        if(new_blk_size%BLK_ALIGN != 0) {
+            error("**Unaligned, %ld mod %d = %ld", new_blk_size, BLK_ALIGN, new_blk_size%BLK_ALIGN);
             return -1;
         }
 
@@ -351,13 +879,14 @@ static int split_blk_if_necessary(mem_list_t * blk, size_t requested_size) {
         new_block->prev_footer = blk->header ^ magic_byte();
         new_block->header = new_blk_size;
 
-        size_t * new_footer = (size_t *)((void *)new_block + new_blk_size + 2*SIZE_HorF);
+        tag_t * new_footer = (tag_t *)((void *)new_block + new_blk_size + 2*SIZE_HorF);
         *new_footer = new_block->header ^ magic_byte();
 
-        insert_blk(new_block);
+        purge_state_init(h, new_block, &purged);
+        insert_blk(h, new_block);
 
-        debug("Required block header=0x%lx@%p, footer=0x%lx@%p, size=%ld", blk->header, &blk->header, new_block->prev_footer, &new_block->prev_footer, requested_size);
-        debug("New block header=0x%lx@%p, footer=0x%lx@%p, size=%ld", new_block->header, &new_block->header, *new_footer, new_footer, new_blk_size);
+        debug("Required block header=0x%lx@%p, footer=0x%lx@%p, size=%ld", (size_t)blk->header, &blk->header, (size_t)new_block->prev_footer, &new_block->prev_footer, requested_size);
+        debug("New block header=0x%lx@%p, footer=0x%lx@%p, size=%ld", (size_t)new_block->header, &new_block->header, (size_t)*new_footer, new_footer, new_blk_size);
     }
 
     return 0;
@@ -366,11 +895,13 @@ static int split_blk_if_necessary(mem_list_t * blk, size_t requested_size) {
 /*
  * Check if the previous blocks and next blocks are free.
  * 
- * Coalesce them if possible.
+ * Coalesce them if possible, the purge state of the coalesced block is 
+ * merged in purged (see purge_state_merge).
  */
-static mem_list_t * coalesce_blk_if_possible(mem_list_t * blk) {
+static mem_list_t * coalesce_blk_if_possible(mm_heap_t * h, mem_list_t * blk, purge_state_t * purged) {
     void * real_header = &(blk->header);
     void * real_footer = (void *)blk + getBlkSize(blk) + 2*SIZE_HorF;
+    size_t largest = getBlkSize(blk);
 
     if(check_blk(blk) != 0) {
         error("Context corrupted");
@@ -378,78 +909,86 @@ static mem_list_t * coalesce_blk_if_possible(mem_list_t * blk) {
     }
 
     // Checking previous block
-    while((size_t)(real_header - SIZE_HorF) > (size_t)port_get_mem_pool_start()) {
+    while((size_t)(real_header - SIZE_HorF) > (size_t)port_get_mem_pool_start(&h->port)) {
         void * prev_footer = real_header - SIZE_HorF;
-        if(((*(size_t *)prev_footer ^ magic_byte()) & alignMask) != 0) {
+        if(((*(tag_t *)prev_footer ^ magic_byte()) & alignMask) != 0) {
             // Block probably already assigned, or undefined
             break;
         }
 
-        size_t prev_size = (*(size_t *)prev_footer ^ magic_byte()) & ~alignMask;
+        size_t prev_size = (*(tag_t *)prev_footer ^ magic_byte()) & ~alignMask;
 
         void * prev_header = prev_footer - prev_size - SIZE_HorF;
-        if((size_t)prev_header <= (size_t)port_get_mem_pool_start()) {
+        if((size_t)prev_header <= (size_t)port_get_mem_pool_start(&h->port)) {
             // Probably undefined block hit
             break;
         }
 
-        if(*(size_t *)prev_header != (magic_byte() ^ *(size_t *)prev_footer)) {
+        if(*(tag_t *)prev_header != (magic_byte() ^ *(tag_t *)prev_footer)) {
             // Check mismatch
             break;
         }
 
         // Update size info
-        size_t * old_head = (size_t *)real_header;
+        tag_t * old_head = (tag_t *)real_header;
         old_head = old_head;
-        size_t old_size = *(size_t *)real_header & ~alignMask;
+        size_t old_size = *(tag_t *)real_header & ~alignMask;
         size_t new_size = old_size + prev_size + 2*SIZE_HorF;
         if((new_size & alignMask) != 0 ) {
             // Block alignment broken
             break;
         }
-        if(delete_block((mem_list_t *)(prev_header-SIZE_HorF)) != 0) {
+        if(delete_block(h, (mem_list_t *)(prev_header-SIZE_HorF)) != 0) {
             // Block delete error
             break;
         }
+        purge_state_merge(purged, &largest, (mem_list_t *)(prev_header-SIZE_HorF));
+        if(h->compact_cursor == blkOffset(h, real_header - SIZE_HorF)) {
+            h->compact_cursor = blkOffset(h, prev_header - SIZE_HorF);
+        }
         real_header = prev_header;
-        *(size_t *)real_header = new_size;
-        *(size_t *)real_footer = *(size_t *)real_header ^ magic_byte();
+        *(tag_t *)real_header = new_size;
+        *(tag_t *)real_footer = *(tag_t *)real_header ^ magic_byte();
 
         debug("Coalescing %ld@%p and %ld@%p into %ld@%p", prev_size, prev_header, old_size, old_head, new_size, real_header);
     }
 
     // Checking next block
-    while((size_t)(real_footer + SIZE_HorF) < (size_t)port_get_mem_pool_end()) {
+    while((size_t)(real_footer + SIZE_HorF) < (size_t)port_get_mem_pool_end(&h->port)) {
         void * next_header = real_footer + SIZE_HorF;
-        if((*(size_t *)next_header & alignMask) != 0) {
+        if((*(tag_t *)next_header & alignMask) != 0) {
             // Block probably already assinged, or undefined
             break;
         }
-        size_t next_size = *(size_t *)next_header & ~alignMask;
+        size_t next_size = *(tag_t *)next_header & ~alignMask;
 
         void * next_footer = next_header + next_size + SIZE_HorF;
-        if((size_t)next_footer >= (size_t)port_get_mem_pool_end()) {
+        if((size_t)next_footer >= (size_t)port_get_mem_pool_end(&h->port)) {
             // Probably undefined block hit
             break;
         }
 
-        if(*(size_t *)next_header != (magic_byte() ^ *(size_t *)next_footer)) {
+        if(*(tag_t *)next_header != (magic_byte() ^ *(tag_t *)next_footer)) {
             // Check mismatch
             break;
         }
 
         // Update size info
-        size_t * old_head = real_header;
+        tag_t * old_head = real_header;
         old_head = old_head;
-        size_t old_size = *(size_t *)real_header & ~alignMask;
+        size_t old_size = *(tag_t *)real_header & ~alignMask;
         size_t new_size = old_size + next_size + 2*SIZE_HorF;
-        if(delete_block(next_header-SIZE_HorF) != 0) {
+        if(delete_block(h, next_header-SIZE_HorF) != 0) {
             // Block delete error
             break;
         }
+        purge_state_merge(purged, &largest, (mem_list_t *)(next_header-SIZE_HorF));
+        if(h->compact_cursor == blkOffset(h, next_header - SIZE_HorF)) {
+            h->compact_cursor = blkOffset(h, real_header - SIZE_HorF);
+        }
         real_footer = next_footer;
-        *(size_t *)real_header = new_size;
-        *(size_t *)real_footer = *(size_t *)real_header ^ magic_byte();
+        *(tag_t *)real_header = new_size;
+        *(tag_t *)real_footer = *(tag_t *)real_header ^ magic_byte();
 
         debug("Coalescing %ld@%p and %ld@%p into %ld@%p", old_size, old_head, next_size, next_header, new_size, real_header);
     }
@@ -457,123 +996,261 @@ static mem_list_t * coalesce_blk_if_possible(mem_list_t * blk) {
     return (mem_list_t *)(real_header-SIZE_HorF);
 }
 
+/*
+ * Release the interior pages of a free block if it has been free for
+ * purge_decay ms (or if force), return the bytes released.
+ * 
+ * With huge pages enabled, only whole huge pages are released so that
+ * the kernel never splits them.
+ */
+static size_t purge_blk(mm_heap_t * h, mem_list_t * blk, size_t now, int force) {
+    purge_state_t * state = purgeState(blk);
+    if(state == NULL || (!force && now < state->freed_at + h->purge_decay)) {
+        return 0;
+    }
+
+    size_t granularity = port_get_huge_page(&h->port)?port_huge_page_size():(size_t)PAGE_SIZE;
+    size_t start = blkOffset(h, blk) + sizeof(mem_list_t) + sizeof(purge_state_t);
+    size_t end = blkOffset(h, blk) + getBlkSize(blk) + 2*SIZE_HorF;
+    start = (start + granularity - 1) & ~(granularity - 1);
+    end = end & ~(granularity - 1);
+
+    if(end <= start || (state->purged_start <= start && state->purged_end >= end)) {
+        // No whole page inside, or already purged
+        return 0;
+    }
+
+    if(port_purge_page(&h->port, offsetBlk(h, start), end - start) != 0) {
+        return 0;
+    }
+    state->purged_start = start;
+    state->purged_end = end;
+
+    debug("Purged %ld byte(s) of %ld@%p", end - start, getBlkSize(blk), blk);
+    return end - start;
+}
+
+/*
+ * Purge every free block large enough, return the bytes released.
+ * 
+ * The free indexes find the large blocks without walking the lists.
+ */
+static size_t heap_purge(mm_heap_t * h, size_t now, int force) {
+    uint32_t key = free_index_key(PURGE_MIN_SIZE);
+    size_t purged = 0;
+
+    for(int i = determine_free_list_idx(PURGE_MIN_SIZE); i < 10; i++) {
+        free_index_t * index = &h->free_index[i];
+
+        if(!index->out_of_sync) {
+            for(ssize_t pos = free_index_first_fit(index, key, 0); pos >= 0; pos = free_index_first_fit(index, key, pos + 1)) {
+                purged += purge_blk(h, offsetBlk(h, index->offsets[pos]), now, force);
+            }
+            continue;
+        }
+        for(mem_list_t * blk = h->free_list[i]; blk != NULL; blk = linkBlk(h, blk->next)) {
+            purged += purge_blk(h, blk, now, force);
+        }
+    }
+
+    return purged;
+}
+
+/*
+ * Amortized purging: every PURGE_TICK calls, check the time, and purge
+ * the heap if purge_decay / 2 ms passed since the last pass.
+ */
+static void purge_if_due(mm_heap_t * h) {
+    if(h->purge_decay < 0 || !h->flag_inited || __atomic_load_n(&purge_thread_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if(h->purge_tick > 0) {
+        h->purge_tick--;
+        return;
+    }
+    h->purge_tick = PURGE_TICK;
+
+    size_t now = port_time_ms();
+    if(now >= h->next_purge) {
+        heap_purge(h, now, 0);
+        h->next_purge = now + h->purge_decay/2;
+    }
+}
+
+/*
+ * Number of pages to add to the heap for a block of size bytes
+ * 
+ * With huge pages enabled, a large extension is rounded up so that the
+ * heap ends on a huge page boundary. The remainder goes to the free list
+ * as part of the new block instead of leaving a partially used huge page
+ * at the end of heap, which would be split by the next extension or trim.
+ */
+static size_t pages_to_extend(mm_heap_t * h, void * heap_end, size_t size) {
+    size_t pages = requiredPage(size);
+    size_t huge_size = port_huge_page_size();
+
+    if(port_get_huge_page(&h->port) && pages*PAGE_SIZE >= huge_size) {
+        size_t new_end = ((size_t)heap_end + pages*PAGE_SIZE + huge_size - 1) & ~(huge_size - 1);
+        size_t extension = new_end - (size_t)heap_end;
+        pages = requiredPage(extension);
+    }
+
+    return pages;
+}
+
+/*
+ * Check if the heap could grow by pages under its budget (see Memory 
+ * Budget), set h->budget_short if not.
+ */
+static int budget_check(mm_heap_t * h, size_t pages) {
+    size_t committed = port_get_mem_pool_end(&h->port) - port_get_mem_pool_start(&h->port);
+    size_t grown = committed + pages*PAGE_SIZE;
+    size_t limit = (h->budget_state == BUDGET_OVER_SOFT || h->budget_soft == 0)?h->budget_hard:h->budget_soft;
+
+    if(limit != 0 && grown > limit) {
+        h->budget_short = 1;
+        return -1;
+    }
+
+    if(h->budget_soft != 0 && grown > h->budget_soft) {
+        h->budget_stats.overruns++;
+    }
+    if(grown > h->budget_stats.peak) {
+        h->budget_stats.peak = grown;
+    }
+    return 0;
+}
+
 /*
  * Find free block, extend page if necessary 
  *
- * FREE_LIST[0] is a FIFO list, which stores blocks smaller than 512 byte
+ * h->free_list[0] is a FIFO list, which stores blocks smaller than 512 byte
  * 
  * But the other lists do not use FIFO policy, the block must be linked 
  * as sorted to find the best-fit block.
  * 
- * FREE_LIST[1] stores blocks up to 1 MB which would not fit in previous list
- * FREE_LIST[2] stores blocks up to 2 MB which would not fit in previous list
- * FREE_LIST[3] stores blocks up to 4 MB which would not fit in previous list
- * FREE_LIST[4] stores blocks up to 8 MB which would not fit in previous list
- * FREE_LIST[5] stores blocks up to 16 MB which would not fit in previous list
- * FREE_LIST[6] stores blocks up to 32 MB which would not fit in previous list
- * FREE_LIST[7] stores blocks up to 64 MB which would not fit in previous list
- * FREE_LIST[8] stores blocks up to 128 MB which would not fit in previous list
- * FREE_LIST[9] stores blocks which would not fit in previous list
+ * h->free_list[1] stores blocks up to 1 MB which would not fit in previous list
+ * h->free_list[2] stores blocks up to 2 MB which would not fit in previous list
+ * h->free_list[3] stores blocks up to 4 MB which would not fit in previous list
+ * h->free_list[4] stores blocks up to 8 MB which would not fit in previous list
+ * h->free_list[5] stores blocks up to 16 MB which would not fit in previous list
+ * h->free_list[6] stores blocks up to 32 MB which would not fit in previous list
+ * h->free_list[7] stores blocks up to 64 MB which would not fit in previous list
+ * h->free_list[8] stores blocks up to 128 MB which would not fit in previous list
+ * h->free_list[9] stores blocks which would not fit in previous list
+ * 
+ * Each list has a FREE_INDEX, the sizes of its blocks stored contiguously,
+ * so the lookup scans the index with SIMD compares instead of loading the
+ * header of every block in the list.
  * 
  */
-static mem_list_t * find_required_block(size_t size) {
-    void * current_heap_end = port_get_mem_pool_end();
+static mem_list_t * find_required_block(mm_heap_t * h, size_t size) {
+    void * current_heap_end = port_get_mem_pool_end(&h->port);
     void * assigned_block = NULL;
     mem_list_t * found_block = NULL;
+    size_t pages = 0;
 
-    switch(determine_free_list(size)) {
+    switch(determine_free_list(h, size)) {
         case 0: // Find in block list[0]
             // FIFO policy (same lookup as sorted lists, first-fit in list order)
-            found_block = find_block_in_list(0, size);
+            found_block = find_block_in_list(h, 0, size);
             if(found_block != NULL) {
                 return found_block;
             }
 
         case 1: // Find in block list[1]
             // Best-Fit policy (Because the list sorted the block size, it's the same operation)
-            found_block = find_block_in_list(1, size);
+            found_block = find_block_in_list(h, 1, size);
             if(found_block != NULL) {
                 return found_block;
             }
 
         case 2: // Find in block list[2]
             // Best-Fit policy (Because the list sorted the block size, it's the same operation)
-            found_block = find_block_in_list(2, size);
+            found_block = find_block_in_list(h, 2, size);
             if(found_block != NULL) {
                 return found_block;
             }
 
         case 3: // Find in block list[3]
             // Best-Fit policy (Because the list sorted the block size, it's the same operation)
-            found_block = find_block_in_list(3, size);
+            found_block = find_block_in_list(h, 3, size);
             if(found_block != NULL) {
                 return found_block;
             }
 
         case 4: // Find in block list[4]
             // Best-Fit policy (Because the list sorted the block size, it's the same operation)
-            found_block = find_block_in_list(4, size);
+            found_block = find_block_in_list(h, 4, size);
             if(found_block != NULL) {
                 return found_block;
             }
 
         case 5: // Find in block list[5]
             // Best-Fit policy (Because the list sorted the block size, it's the same operation)
-            found_block = find_block_in_list(5, size);
+            found_block = find_block_in_list(h, 5, size);
             if(found_block != NULL) {
                 return found_block;
             }
 
         case 6: // Find in block list[6]
             // Best-Fit policy (Because the list sorted the block size, it's the same operation)
-            found_block = find_block_in_list(6, size);
+            found_block = find_block_in_list(h, 6, size);
             if(found_block != NULL) {
                 return found_block;
             }
 
         case 7: // Find in block list[7]
             // Best-Fit policy (Because the list sorted the block size, it's the same operation)
-            found_block = find_block_in_list(7, size);
+            found_block = find_block_in_list(h, 7, size);
             if(found_block != NULL) {
                 return found_block;
             }
 
         case 8: // Find in block list[8]
             // Best-Fit policy (Because the list sorted the block size, it's the same operation)
-            found_block = find_block_in_list(8, size);
+            found_block = find_block_in_list(h, 8, size);
             if(found_block != NULL) {
                 return found_block;
             }
 
         case 9: // Find in block list[9]
             // Best-Fit policy (Because the list sorted the block size, it's the same operation)
-            found_block = find_block_in_list(9, size);
+            found_block = find_block_in_list(h, 9, size);
             if(found_block != NULL) {
                 return found_block;
             }
 
         case 10: // None block satisfy the condition
             // Extend heap
-            if(port_extend_page(requiredPage(actualBlkSize(size))) != 0) {
+            pages = pages_to_extend(h, current_heap_end, actualBlkSize(size));
+            if(budget_check(h, pages) != 0) {
                 return NULL;
             }
-            debug("Successfully extended %ld page(s)", requiredPage(actualBlkSize(size)));
+            if(port_extend_page(&h->port, pages) != 0) {
+                return NULL;
+            }
+            debug("Successfully extended %ld page(s)", pages);
+            h->policy_stats.extensions[h->policy]++;
 
             assigned_block = current_heap_end - 2*SIZE_HorF;
 
             // Init Heap Header & Epilogue Block Footer
-            void * ptr_heap_header = port_get_mem_pool_start();
-            current_heap_end = port_get_mem_pool_end();
+            void * ptr_heap_header = port_get_mem_pool_start(&h->port);
+            current_heap_end = port_get_mem_pool_end(&h->port);
             debug("Heap: start=%p, end=%p", ptr_heap_header, current_heap_end);
-            *(size_t *)(ptr_heap_header + WORD_SIZE) = (current_heap_end-ptr_heap_header) | 0x1;
+            *(tag_t *)(ptr_heap_header + WORD_SIZE) = (current_heap_end-ptr_heap_header) | 0x1;
             debug("Writing to %p", (current_heap_end - SIZE_HorF));
-            *(size_t *)(current_heap_end - SIZE_HorF) = 0x1;
+            *(tag_t *)(current_heap_end - SIZE_HorF) = 0x1;
 
             // Init new block
-            ((mem_list_t *)assigned_block)->header = requiredPage(actualBlkSize(size))*PAGE_SIZE - 2*SIZE_HorF;
-            *(size_t *)(current_heap_end - 2*SIZE_HorF) = ((mem_list_t *)assigned_block)->header ^ magic_byte();
+            ((mem_list_t *)assigned_block)->header = pages*PAGE_SIZE - 2*SIZE_HorF;
+            *(tag_t *)(current_heap_end - 2*SIZE_HorF) = ((mem_list_t *)assigned_block)->header ^ magic_byte();
 
-            insert_blk((mem_list_t *)(assigned_block));
+            // Fresh pages are zero
+            purge_state_t fresh = {0, 0, SIZE_MAX};
+            purge_state_init(h, (mem_list_t *)assigned_block, &fresh);
+            insert_blk(h, (mem_list_t *)(assigned_block));
 
             return (mem_list_t *)(assigned_block);
 
@@ -585,13 +1262,15 @@ static mem_list_t * find_required_block(size_t size) {
 /*
  * 
  */
-static int mm_initialize(void) {    
+static int mm_initialize(mm_heap_t * h) {    
     // If already inited, exit
-    if(flag_inited)
+    if(h->flag_inited)
         return 0;
 
+    resolve_policy(h);
+
     // Get the first page
-    if(port_extend_page(1) != 0) {
+    if(port_extend_page(&h->port, 1) != 0) {
         error("Page extend failed!");
         return -1;
     }
@@ -602,11 +1281,11 @@ static int mm_initialize(void) {
     }
 
     for(int i = 0; i < 10; i++) {
-        FREE_LIST[i] = NULL;
+        h->free_list[i] = NULL;
     }
 
-    void * heap_start = port_get_mem_pool_start();
-    void * heap_end = port_get_mem_pool_end();
+    void * heap_start = port_get_mem_pool_start(&h->port);
+    void * heap_end = port_get_mem_pool_end(&h->port);
 
     if(((size_t)heap_start & alignMask) != 0) {
         error("Heap start address incompatible");
@@ -614,100 +1293,272 @@ static int mm_initialize(void) {
     }
     
     // Init Heap header
-    *(size_t *)(heap_start + WORD_SIZE) = (heap_end-heap_start) | 0x1;
+    *(tag_t *)(heap_start + WORD_SIZE) = (heap_end-heap_start) | 0x1;
 
     // Init epilogue footer
     void * epilogue_footer = heap_end - SIZE_HorF;
-    *(size_t *)epilogue_footer = 0x1;
+    *(tag_t *)epilogue_footer = 0x1;
 
-    // Init prologue block
-    void * prologue_header = heap_start + WORD_SIZE;
-    void * prologue_footer = prologue_header + 3*SIZE_HorF;
-    *(size_t *)prologue_header = 2*WORD_SIZE | 0x1;
-    *(size_t *)prologue_footer = *(size_t *)prologue_header ^ magic_byte();
+    // Init prologue block, the first block starts at heap_start + 4*WORD_SIZE
+    void * prologue_header = heap_start + 2*WORD_SIZE - SIZE_HorF;
+    void * prologue_footer = prologue_header + SIZE_HorF + 2*WORD_SIZE;
+    *(tag_t *)prologue_header = 2*WORD_SIZE | 0x1;
+    *(tag_t *)prologue_footer = *(tag_t *)prologue_header ^ magic_byte();
 
     // Init new block
     mem_list_t * new_block = (mem_list_t *)prologue_footer;
-    new_block->header = PAGE_SIZE - WORD_SIZE * 8;
-    *(size_t *)(epilogue_footer - SIZE_HorF) = new_block->header ^ magic_byte();
+    new_block->header = PAGE_SIZE - 4*WORD_SIZE - 4*SIZE_HorF;
+    *(tag_t *)(epilogue_footer - SIZE_HorF) = new_block->header ^ magic_byte();
 
-    debug("Init: prologue_header=%lx, prologue_footer=%lx, epilogue_footer=%lx, initial_block_header=%lx, initial_block_footer=%lx", *(size_t *)(heap_start+WORD_SIZE), *(size_t *)(heap_start+4*WORD_SIZE), *(size_t *)(heap_end-WORD_SIZE), *(size_t *)(heap_start+5*WORD_SIZE), *(size_t *)(heap_end-2*WORD_SIZE));
+    debug("Init: prologue_header=%lx, prologue_footer=%lx, epilogue_footer=%lx, initial_block_header=%lx, initial_block_footer=%lx", (size_t)*(tag_t *)prologue_header, (size_t)*(tag_t *)prologue_footer, (size_t)*(tag_t *)epilogue_footer, (size_t)new_block->header, (size_t)*(tag_t *)(epilogue_footer - SIZE_HorF));
 
-    insert_blk(new_block);
+    purge_state_t fresh = {0, 0, SIZE_MAX};
+    purge_state_init(h, new_block, &fresh);
+    insert_blk(h, new_block);
 
-    flag_inited = 1;
+    h->flag_inited = 1;
 
     
     return 0;
 }
 
-/* ==================================================================================
- * |                   Functions below are public interfaces                        |
- * ==================================================================================
- */
+static int heap_contains(mm_heap_t * h, void * ptr) {
+    return h->flag_inited && ptr >= port_get_mem_pool_start(&h->port) && ptr < port_get_mem_pool_end(&h->port);
+}
 
 /*
- * Memory Alloc Policy:
- * 
- * 1. Find best-fit blocks in free list (FIFO for block less than 512 byte),
- *    goto 3 if found.
- * 2. Add extra pages to memory pool as required.
- * 3. If the reminder greater then the Minimal Block Size, Split 
- *    the block and put the reminder into proper Free List.
- * 4. Initialize the block and return the pointer to content.
- * 
- * To ensure blocks can be inserted into list (reserved space for list node), 
- * also for fragmentation consideration, the minimal block size was set to 
- * 16 bytes. which means malloc(1) would return a block contain space of 16
- * bytes even if it's a kind of waste.
- * 
- * Also, when spliting the memory blocks, the minimal block size would 
- * be 16 bytes.
- * 
+ * Return the heap whose memory pool contains ptr, or NULL if none. The
+ * caller holds heap_list_lock.
  */
-void * my_malloc(size_t size) {
-    if(mm_initialize() != 0) {
-        error("Unable to initialize");
+static mm_heap_t * heap_of_locked(void * ptr) {
+    for(mm_heap_t * h = heap_list; h != NULL; h = h->next) {
+        if(heap_contains(h, ptr)) {
+            return h;
+        }
     }
-    
-    // Get the actual size which fit the alignment requirement
-    debug("Request %ld, assign %ld", size, alignedSize(size));
+    return NULL;
+}
 
-    size = alignedSize(size);
-    // Enforce minimum block size so split_blk_if_necessary never creates a zero-size block
-    if(size < 2*WORD_SIZE) {
-        size = 2*WORD_SIZE;
+/*
+ * Return the heap whose memory pool contains ptr, or NULL if none. A 
+ * heap other than the default heap is not unmapped before the matching
+ * heap_unlookup.
+ */
+static mm_heap_t * heap_lookup(void * ptr) {
+    if(heap_contains(&default_heap, ptr)) {
+        return &default_heap;
     }
-    // Find block
-    mem_list_t * assigned_block = find_required_block(size);
 
-    if(assigned_block == NULL) {
-        error("No Enough Mem!");
-        return NULL;
+    __atomic_add_fetch(&heap_list_readers, 1, __ATOMIC_SEQ_CST);
+    for(mm_heap_t * h = __atomic_load_n(&default_heap.next, __ATOMIC_ACQUIRE); h != NULL; h = __atomic_load_n(&h->next, __ATOMIC_ACQUIRE)) {
+        if(heap_contains(h, ptr)) {
+            return h;
+        }
     }
+    __atomic_sub_fetch(&heap_list_readers, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    // Check block
-    if(check_blk(assigned_block) != 0) {
-        error("Block corrupted");
-        return NULL;
+static void heap_unlookup(mm_heap_t * h) {
+    if(h != NULL && h != &default_heap) {
+        __atomic_sub_fetch(&heap_list_readers, 1, __ATOMIC_RELEASE);
     }
+}
 
-    // Fetch from free list
-    delete_block(assigned_block);
+static size_t free_drain(void);
+static int heap_compact_step(mm_heap_t * h, size_t budget);
+
+/*
+ * Relieve the budget pressure to serve a block of size bytes (see Memory
+ * Budget), return the block found or NULL.
+ */
+static mem_list_t * budget_pressure(mm_heap_t * h, size_t size) {
+    mem_list_t * blk = NULL;
+
+    h->budget_short = 0;
+    if(h->budget_state != BUDGET_NORMAL) {
+        // Allocation of a reclaim callback
+        return NULL;
+    }
+    h->budget_state = BUDGET_PRESSURE;
+    h->budget_stats.pressure++;
+    debug("Budget pressure, %ld byte(s) requested", size);
+
+    size_t committed = port_get_mem_pool_end(&h->port) - port_get_mem_pool_start(&h->port);
+    size_t now = port_time_ms();
+
+    if(h->budget_soft != 0 && committed > h->budget_soft && h->relief_time != 0 && 
+        now - h->relief_time < BUDGET_RELIEF_INTERVAL && 
+        committed - h->relief_size < h->budget_soft/BUDGET_RELIEF_SLICE) {
+        // Relieved in this crossing already, extend past the soft limit
+        h->budget_state = BUDGET_OVER_SOFT;
+        blk = find_required_block(h, size);
+        if(blk != NULL || !h->budget_short) {
+            h->budget_stats.skipped++;
+            h->budget_state = BUDGET_NORMAL;
+            return blk;
+        }
+        // Held back by the hard limit
+        h->budget_short = 0;
+        h->budget_state = BUDGET_PRESSURE;
+    }
+
+    // 1. Internal reclamation
+    heapUnlock(h);
+    free_drain();
+    heapLock(h);
+    for(size_t budget = actualBlkSize(size); ; budget = (budget > SIZE_MAX/2)?SIZE_MAX:2*budget) {
+        int done = heap_compact_step(h, budget);
+
+        blk = find_required_block(h, size);
+        if(blk != NULL || !h->budget_short || done) {
+            break;
+        }
+        h->budget_short = 0;
+    }
+    if(blk == NULL && h->budget_short) {
+        heap_purge(h, port_time_ms(), 0);
+    }
+    if(blk != NULL) {
+        h->budget_stats.relieved++;
+    }
+
+    // 2. Reclaim callbacks
+    for(size_t i = 0; blk == NULL && h->budget_short && i < h->reclaim_count; i++) {
+        reclaim_entry_t reclaim = h->reclaims[i];
+        h->budget_short = 0;
+
+        heapUnlock(h);
+        size_t freed = reclaim.fn(actualBlkSize(size), reclaim.arg);
+        heapLock(h);
+
+        h->budget_stats.callback_calls++;
+        h->budget_stats.callback_bytes += freed;
+        blk = find_required_block(h, size);
+    }
+
+    // 3. Past the soft limit
+    if(blk == NULL && h->budget_short) {
+        h->budget_short = 0;
+        h->budget_state = BUDGET_OVER_SOFT;
+        blk = find_required_block(h, size);
+    }
+    if(blk == NULL && h->budget_short) {
+        h->budget_short = 0;
+        h->budget_stats.denied++;
+        warn("Heap budget exhausted, %ld byte(s) requested", size);
+    }
+
+    h->relief_time = port_time_ms();
+    h->relief_size = port_get_mem_pool_end(&h->port) - port_get_mem_pool_start(&h->port);
+    h->budget_state = BUDGET_NORMAL;
+    return blk;
+}
+
+/*
+ * Memory Alloc Policy:
+ * 
+ * 1. Find best-fit blocks in free list (FIFO for block less than 512 byte),
+ *    goto 3 if found.
+ * 2. Add extra pages to memory pool as required.
+ * 3. If the reminder greater then the Minimal Block Size, Split 
+ *    the block and put the reminder into proper Free List.
+ * 4. Initialize the block and return the pointer to content.
+ * 
+ * To ensure blocks can be inserted into list (reserved space for list node), 
+ * also for fragmentation consideration, the minimal block size was set to 
+ * 16 bytes. which means malloc(1) would return a block contain space of 16
+ * bytes even if it's a kind of waste.
+ * 
+ * Also, when spliting the memory blocks, the minimal block size would 
+ * be 16 bytes.
+ * 
+ */
+PROFILE_SECTION static void * heap_malloc(mm_heap_t * h, size_t size) {
+    if(mm_initialize(h) != 0) {
+        error("Unable to initialize");
+        return NULL;
+    }
+    
+    // Get the actual size which fit the alignment requirement
+    debug("Request %ld, assign %ld", size, alignedSize(size));
+
+    // Enforce minimum block size so split_blk_if_necessary never creates a zero-size block
+    size = requestBlkSize(size);
+    // Find block
+    mem_list_t * assigned_block = find_required_block(h, size);
+    if(assigned_block == NULL && h->budget_short) {
+        assigned_block = budget_pressure(h, size);
+    }
+
+    if(assigned_block == NULL) {
+        error("No Enough Mem!");
+        return NULL;
+    }
+    h->policy_stats.requests[h->policy]++;
+    debug("Request %ld served by %s", size, policy_names[h->policy]);
+
+    // Check block
+    if(check_blk(assigned_block) != 0) {
+        error("Block corrupted");
+        return NULL;
+    }
+
+    // Purged pages of the block read as zero
+    purge_state_t purged = {0, 0, 0};
+    if(purgeState(assigned_block) != NULL) {
+        purged = *purgeState(assigned_block);
+    }
+
+    // Fetch from free list
+    delete_block(h, assigned_block);
 
     // Set assign bit
     assigned_block->header = assigned_block->header | 0x1;
-    size_t * footer = (void *)assigned_block + getBlkSize(assigned_block) + 2*SIZE_HorF;
+    tag_t * footer = (void *)assigned_block + getBlkSize(assigned_block) + 2*SIZE_HorF;
     *footer = assigned_block->header ^ magic_byte();
 
-    split_blk_if_necessary(assigned_block, size);
+    split_blk_if_necessary(h, assigned_block, size);
 
     // For security reasons, initialize the content to 0
-    memset((void *)assigned_block + 2*SIZE_HorF, 0, size);
+    zero_payload(h, (void *)assigned_block + 2*SIZE_HorF, size, purged.purged_start, purged.purged_end);
+
+    // Heap profiler, a single decrement unless the allocation is sampled
+    if((profile_countdown -= size) < 0 && profile_sample((void *)assigned_block + 2*SIZE_HorF, size) == 0) {
+        assigned_block->header = assigned_block->header | SAMPLED_FLAG;
+        footer = (void *)assigned_block + getBlkSize(assigned_block) + 2*SIZE_HorF;
+        *footer = assigned_block->header ^ magic_byte();
+    }
 
     return (void *)assigned_block + 2*SIZE_HorF;
 }
 
+/*
+ * Return an allocated block to the free lists: clear the flags, coalesce
+ * and insert. The block must have been validated.
+ */
+static int heap_release(mm_heap_t * h, mem_list_t * blk) {
+    if((blk->header & SAMPLED_FLAG) != 0) {
+        profile_retire((void *)blk + 2*SIZE_HorF);
+    }
+
+    // Clear assign bit
+    blk->header = blk->header & ~alignMask;
+    tag_t * footer = (tag_t *)((void *)blk + getBlkSize(blk) + 2*SIZE_HorF);
+    *footer = blk->header ^ magic_byte();
+
+    purge_state_t purged = {0, 0, 0};
+    blk = coalesce_blk_if_possible(h, blk, &purged);
+    if(blk == NULL) {
+        error("Coalesce failed!");
+        return -1;
+    }
+    purge_state_init(h, blk, &purged);
+    insert_blk(h, blk);
+
+    return 0;
+}
+
 /*
  * Memory Free Procedure:
  * 
@@ -717,16 +1568,16 @@ void * my_malloc(size_t size) {
  * 2. Keep doing step 1 until no more block could be combined.
  * 
  */
-int my_free(void * ptr) {
+static int heap_free(mm_heap_t * h, void * ptr) {
     mem_list_t * blk = ptr - 2*SIZE_HorF;
 
-    debug("Freeing %p blk: header=%lx@%p, footer=%lx@%p", blk, blk->header, &blk->header, *(size_t *)((void *)blk+getBlkSize(blk)+2*SIZE_HorF), (void *)blk+getBlkSize(blk)+2*SIZE_HorF);
-
-    if((void *)blk > port_get_mem_pool_end() || (void *)blk < port_get_mem_pool_start()) {
+    if(!h->flag_inited || (void *)blk > port_get_mem_pool_end(&h->port) || (void *)blk < port_get_mem_pool_start(&h->port)) {
         error("Invalid address!");
         return -1;
     }
 
+    debug("Freeing %p blk: header=%lx@%p, footer=%lx@%p", blk, (size_t)blk->header, &blk->header, (size_t)*(tag_t *)((void *)blk+getBlkSize(blk)+2*SIZE_HorF), (void *)blk+getBlkSize(blk)+2*SIZE_HorF);
+
     if((blk->header & alignMask) == 0) {
         error("Double free!");
         return -1;
@@ -737,32 +1588,26 @@ int my_free(void * ptr) {
         return -1;
     }
 
-    // Clear assign bit
-    blk->header = blk->header & ~alignMask;
-    size_t * footer = (size_t *)((void *)blk + getBlkSize(blk) + 2*SIZE_HorF);
-    *footer = blk->header ^ magic_byte();
-
-    blk = coalesce_blk_if_possible(blk);
-    if(blk == NULL) {
-        error("Coalesce failed!");
-        return -1;
-    }
-    insert_blk(blk);
-
-    return 0;
+    return heap_release(h, blk);
 }
 
 /*
- * Just implementation of malloc(n_elements*element_size)
+ * Free a block of known size (see my_free_sized).
  * 
+ * Release builds trust the caller and skip the validation of heap_free,
+ * debug builds also check that size fits the block.
  */
-void * my_calloc(size_t n_elements, size_t element_size) {
-    if(n_elements == 0 || element_size == 0)
-        return NULL;
-    if(element_size <= (SIZE_MAX/n_elements))
-        return my_malloc(n_elements*element_size);
-    else // Overflow
-        return NULL;   
+static int heap_free_sized(mm_heap_t * h, void * ptr, size_t size) {
+#ifdef DEBUG
+    mem_list_t * blk = ptr - 2*SIZE_HorF;
+    if((blk->header & alignMask) != 0 && alignedSize(size) > getBlkSize(blk)) {
+        error("Block of %ld byte(s) freed as %ld byte(s)", getBlkSize(blk), size);
+        return -1;
+    }
+    return heap_free(h, ptr);
+#else
+    return heap_release(h, ptr - 2*SIZE_HorF);
+#endif
 }
 
 /*
@@ -771,29 +1616,1361 @@ void * my_calloc(size_t n_elements, size_t element_size) {
  *    abandon data which would cause overflow.
  * 3. Free old block.
  */
-void * my_realloc(void * p, size_t size) {
+PROFILE_SECTION static void * heap_realloc(mm_heap_t * h, void * p, size_t size) {
     if(p == NULL) {
-        return my_malloc(size);
+        return heap_malloc(h, size);
     }
     if(size == 0) {
-        my_free(p);
+        heap_free(h, p);
         return NULL;
     }
 
     mem_list_t * blk = p - 2*SIZE_HorF;
     size_t old_size = getBlkSize(blk);
     
-    void * new_space = my_malloc(size);
+    void * new_space = heap_malloc(h, size);
     if(new_space == NULL) {
         return NULL;
     }
-    memcpy(new_space, p, (old_size < size)?(old_size):(size));
+    bulk_copy(new_space, p, (old_size < size)?(old_size):(size));
 
-    if(my_free(p)) {
+    if(heap_free(h, p)) {
         // Error occurred
-        my_free(new_space);
+        heap_free(h, new_space);
         return NULL;
     }
     
     return new_space;
-}
\ No newline at end of file
+}
+
+/*
+ * Release the free space at the end of heap to the system:
+ * 
+ * 1. Check if the last block before Epilogue Block is free.
+ * 2. Keep pad bytes (and at least a minimal block) in the last block,
+ *    move the heap end down to the trim granularity boundary above it.
+ * 3. Rebuild the last block and Epilogue Block, then shrink the heap.
+ * 
+ * The trim granularity is the huge page size when huge pages are enabled,
+ * so that huge pages are released whole and never split by the kernel.
+ */
+static int heap_trim(mm_heap_t * h, size_t pad) {
+    if(!h->flag_inited) {
+        return 0;
+    }
+
+    void * heap_start = port_get_mem_pool_start(&h->port);
+    void * heap_end = port_get_mem_pool_end(&h->port);
+    tag_t last_header = *(tag_t *)(heap_end - 2*SIZE_HorF) ^ magic_byte();
+
+    if((last_header & alignMask) != 0) {
+        // Last block in use (or Prologue Block), nothing to release
+        return 0;
+    }
+
+    mem_list_t * last = heap_end - 4*SIZE_HorF - (last_header & ~alignMask);
+    if((void *)last < heap_start || check_blk(last) != 0) {
+        error("Last block corrupted");
+        return -1;
+    }
+
+    size_t granularity = port_get_huge_page(&h->port)?port_huge_page_size():(size_t)PAGE_SIZE;
+    pad = alignedSize(pad);
+    if(pad < MIN_PAYLOAD) {
+        pad = MIN_PAYLOAD;
+    }
+
+    // New heap end must leave whole pages to release
+    size_t keep_end = (size_t)last + 2*SIZE_HorF + pad + 2*SIZE_HorF;
+    size_t new_end = (keep_end + granularity - 1) & ~(granularity - 1);
+    if(new_end >= (size_t)heap_end) {
+        return 0;
+    }
+    new_end += ((size_t)heap_end - new_end) % PAGE_SIZE;
+    int pages = ((size_t)heap_end - new_end) / PAGE_SIZE;
+    if(pages == 0) {
+        return 0;
+    }
+
+    purge_state_t purged = {0, 0, 0};
+    if(purgeState(last) != NULL) {
+        purged = *purgeState(last);
+    }
+
+    if(delete_block(h, last) != 0) {
+        return -1;
+    }
+
+    if(port_shrink_page(&h->port, pages) != 0) {
+        insert_blk(h, last);
+        return -1;
+    }
+    heap_end = port_get_mem_pool_end(&h->port);
+
+    // Rebuild last block, Heap header & Epilogue Block Footer
+    last->header = (size_t)heap_end - 4*SIZE_HorF - (size_t)last;
+    *(tag_t *)(heap_end - 2*SIZE_HorF) = last->header ^ magic_byte();
+    *(tag_t *)(heap_end - SIZE_HorF) = 0x1;
+    *(tag_t *)(heap_start + WORD_SIZE) = (heap_end-heap_start) | 0x1;
+
+    debug("Trimmed %d page(s), last block %ld@%p", pages, getBlkSize(last), last);
+
+    purge_state_init(h, last, &purged);
+    return insert_blk(h, last);
+}
+
+/*
+ * Make a free block of size bytes at blk, inside the reserved space, 
+ * return the position of the next block.
+ */
+static mem_list_t * reserve_carve(mm_heap_t * h, mem_list_t * blk, size_t size, purge_state_t * reserved) {
+    blk->header = size;
+    *(tag_t *)((void *)blk + size + 2*SIZE_HorF) = blk->header ^ magic_byte();
+    purge_state_init(h, blk, reserved);
+    insert_blk(h, blk);
+    return (void *)blk + size + 2*SIZE_HorF;
+}
+
+/*
+ * Order in which the profile classes are carved: classes of the LIFO 
+ * h->free_list[0] the largest first, so that the newest block fitting a
+ * request is of its own class, classes of sorted lists the smallest 
+ * first, so that each block is inserted at the head of its list.
+ */
+static size_t reserve_rank(size_t size) {
+    return (determine_free_list_idx(size) == 0)?512 - size:size;
+}
+
+/*
+ * Pre-warm the heap (see my_reserve):
+ * 
+ * 1. Take a free block large enough for the reserved space, extending 
+ *    the heap once if none fits. The part beyond the reserved space goes
+ *    back to the free lists.
+ * 2. Zero the reserved space where it is not purged, and fault its pages
+ *    in, so that it's resident and reads as zero.
+ * 3. Carve the blocks of the profile class by class (see reserve_rank),
+ *    then the rest of the reserved space as one block.
+ * 
+ * The reserved space is recorded as the purged range of its blocks: 
+ * my_malloc does not zero it again, and purge passes find nothing left
+ * to release until a block made of it is freed.
+ */
+static int heap_reserve(mm_heap_t * h, size_t bytes, const my_reserve_class_t * profile) {
+    if(mm_initialize(h) != 0) {
+        error("Unable to initialize");
+        return -1;
+    }
+
+    // Bytes of the profile blocks, boundary tags included
+    size_t profile_bytes = 0;
+    for(const my_reserve_class_t * c = profile; c != NULL && c->size != 0; c++) {
+        if(c->size > SIZE_MAX/2 || (c->count != 0 && c->count > (SIZE_MAX/2 - profile_bytes)/(requestBlkSize(c->size) + 2*SIZE_HorF))) {
+            error("Reserve profile too large");
+            return -1;
+        }
+        profile_bytes += c->count*(requestBlkSize(c->size) + 2*SIZE_HorF);
+    }
+    if(bytes > SIZE_MAX/2) {
+        error("Unable to reserve %ld byte(s)", bytes);
+        return -1;
+    }
+
+    // The profile fills the reserved space, or leaves at least a minimal block after it
+    size_t total = requestBlkSize(bytes) + 2*SIZE_HorF;
+    if(total < profile_bytes) {
+        total = profile_bytes;
+    }
+    else if(total > profile_bytes && total - profile_bytes < MIN_PAYLOAD + 2*SIZE_HorF) {
+        total = profile_bytes + MIN_PAYLOAD + 2*SIZE_HorF;
+    }
+    size_t size = total - 2*SIZE_HorF;
+
+    // 1. Take the block
+    mem_list_t * blk = find_required_block(h, size);
+    if(blk == NULL) {
+        h->budget_short = 0;
+        error("Unable to reserve %ld byte(s)", size);
+        return -1;
+    }
+    purge_state_t purged = {0, 0, 0};
+    if(purgeState(blk) != NULL) {
+        purged = *purgeState(blk);
+    }
+    delete_block(h, blk);
+    split_blk_if_necessary(h, blk, size);
+
+    // 2. Zero and fault in
+    void * start = (void *)blk + 2*SIZE_HorF;
+    void * end = start + getBlkSize(blk);
+    size_t page_mask = PAGE_SIZE - 1;
+    zero_payload(h, start, end - start, purged.purged_start, purged.purged_end);
+    void * first_page = (void *)((size_t)start & ~page_mask);
+    void * last_page = (void *)(((size_t)end + page_mask) & ~page_mask);
+    port_populate_page(&h->port, first_page, last_page - first_page);
+
+    // 3. Carve, the space left is 0 or at least a minimal block after each block
+    purge_state_t reserved = {0, blkOffset(h, start), blkOffset(h, end)};
+    mem_list_t * next = blk;
+    size_t carved_rank = 0;
+    ssize_t carved = -1;
+    for(;;) {
+        ssize_t idx = -1;
+        for(ssize_t i = 0; profile != NULL && profile[i].size != 0; i++) {
+            size_t rank = reserve_rank(requestBlkSize(profile[i].size));
+            if((rank > carved_rank || (rank == carved_rank && i > carved)) && (idx < 0 || rank < reserve_rank(requestBlkSize(profile[idx].size)))) {
+                idx = i;
+            }
+        }
+        if(idx < 0) {
+            break;
+        }
+        carved = idx;
+        carved_rank = reserve_rank(requestBlkSize(profile[idx].size));
+        size_t carved_size = requestBlkSize(profile[idx].size);
+
+        for(size_t n = 0; n < profile[idx].count; n++) {
+            size_t left = (void *)end - (void *)next;
+            if(left < carved_size + 2*SIZE_HorF || (left != carved_size + 2*SIZE_HorF && left - carved_size - 2*SIZE_HorF < MIN_PAYLOAD + 2*SIZE_HorF)) {
+                break;
+            }
+            next = reserve_carve(h, next, carved_size, &reserved);
+        }
+    }
+    if((void *)next < end) {
+        reserve_carve(h, next, (void *)end - (void *)next - 2*SIZE_HorF, &reserved);
+    }
+
+    debug("Reserved %ld byte(s) at %p, %ld byte(s) in profile blocks", (size_t)(end - start), start, profile_bytes);
+    return 0;
+}
+
+/*
+ * Take a free entry of the handle table, growing the table if necessary
+ * 
+ * Return the handle, or 0 if the table could not grow.
+ */
+static size_t handle_new(mm_heap_t * h) {
+    if(h->handle_free != 0) {
+        size_t handle = h->handle_free;
+        h->handle_free = h->handles[handle - 1].next_free;
+        return handle;
+    }
+
+    if(h->handle_count == h->handle_capacity) {
+        size_t capacity = (h->handle_capacity == 0)?PAGE_SIZE/sizeof(handle_entry_t):2*h->handle_capacity;
+        handle_entry_t * handles;
+        if(h->handles == NULL) {
+            handles = port_map_meta(capacity*sizeof(handle_entry_t));
+        }
+        else {
+            handles = port_remap_meta(h->handles, h->handle_capacity*sizeof(handle_entry_t), capacity*sizeof(handle_entry_t));
+        }
+        if(handles == NULL) {
+            return 0;
+        }
+        h->handles = handles;
+        h->handle_capacity = capacity;
+    }
+
+    return ++h->handle_count;
+}
+
+/*
+ * Return the entry of handle, or NULL if it is not an allocated handle
+ */
+static handle_entry_t * handle_entry(mm_heap_t * h, size_t handle) {
+    if(handle == 0 || handle > h->handle_count || h->handles[handle - 1].ptr == NULL) {
+        return NULL;
+    }
+    return &h->handles[handle - 1];
+}
+
+/*
+ * Slide the movable block after free block blk down to the start of blk,
+ * the free space goes after the moved block:
+ * 
+ * | blk (free) | next (movable) | ...   =>   | next (moved) | blk (free) | ...
+ * 
+ * The free block is coalesced with the block following it, and returned.
+ */
+static mem_list_t * slide_blk(mm_heap_t * h, mem_list_t * blk, mem_list_t * next) {
+    size_t free_size = getBlkSize(blk);
+    size_t size = getBlkSize(next);
+    size_t flags = next->header & alignMask;
+    void * old_payload = (void *)next + 2*SIZE_HorF;
+    void * new_payload = (void *)blk + 2*SIZE_HorF;
+    handle_entry_t * entry = handle_entry(h, *(size_t *)old_payload);
+
+    if(entry == NULL || entry->locks != 0) {
+        error("Movable block %p has no unlocked handle", next);
+        return NULL;
+    }
+
+    if(delete_block(h, blk) != 0) {
+        return NULL;
+    }
+
+    memmove(new_payload, old_payload, size);
+
+    // Moved block
+    blk->header = size | flags;
+    *(tag_t *)((void *)blk + size + 2*SIZE_HorF) = blk->header ^ magic_byte();
+
+    // Free block after it, its footer is the footer of the old block
+    mem_list_t * free_blk = (void *)blk + size + 2*SIZE_HorF;
+    free_blk->header = free_size;
+    *(tag_t *)((void *)free_blk + free_size + 2*SIZE_HorF) = free_blk->header ^ magic_byte();
+
+    entry->ptr = new_payload + HANDLE_PREFIX;
+    if((flags & SAMPLED_FLAG) != 0) {
+        profile_move(old_payload, new_payload);
+    }
+
+    debug("Moved %ld@%p to %p", size, next, blk);
+
+    purge_state_t purged = {0, 0, 0};
+    free_blk = coalesce_blk_if_possible(h, free_blk, &purged);
+    if(free_blk == NULL) {
+        return NULL;
+    }
+    purge_state_init(h, free_blk, &purged);
+    insert_blk(h, free_blk);
+
+    return free_blk;
+}
+
+/*
+ * Incremental Compaction:
+ * 
+ * 1. Walk blocks in address order from the compaction cursor.
+ * 2. When a free block is followed by an unlocked movable block, slide
+ *    the movable block down, so the free space moves toward heap end
+ *    and merges with the free blocks it meets.
+ * 3. Stop once budget is spent, every block visited costs 
+ *    COMPACT_VISIT_COST and every block moved costs its size, whether
+ *    anything moved or not, so a step over pinned or fixed blocks is
+ *    bounded as well. At least one block is visited per call.
+ * 4. At the end of heap, trim the free tail and restart from the first
+ *    block next time.
+ * 
+ * The cursor is the offset of a block, coalescing moves it to the start 
+ * of the coalesced block (see coalesce_blk_if_possible).
+ * 
+ * Return 1 if the pass reached the end of heap, 0 otherwise.
+ */
+#define COMPACT_VISIT_COST  64
+
+static int heap_compact_step(mm_heap_t * h, size_t budget) {
+    if(!h->flag_inited) {
+        return 1;
+    }
+
+    void * heap_end = port_get_mem_pool_end(&h->port);
+    mem_list_t * last = heap_end - 2*SIZE_HorF;
+    mem_list_t * blk = (h->compact_cursor != 0)?offsetBlk(h, h->compact_cursor):offsetBlk(h, 4*WORD_SIZE);
+    int visited = 0;
+
+    while(blk < last && (budget > 0 || !visited)) {
+        visited = 1;
+        mem_list_t * next = (void *)blk + getBlkSize(blk) + 2*SIZE_HorF;
+        budget = (budget > COMPACT_VISIT_COST)?budget - COMPACT_VISIT_COST:0;
+
+        if((blk->header & alignMask) != 0 || next >= last || (next->header & MOVABLE_FLAG) == 0) {
+            blk = next;
+            continue;
+        }
+        handle_entry_t * entry = handle_entry(h, *(size_t *)((void *)next + 2*SIZE_HorF));
+        if(entry == NULL || entry->locks != 0) {
+            // Pinned, the free block stays
+            blk = next;
+            continue;
+        }
+
+        size_t size = getBlkSize(next);
+        blk = slide_blk(h, blk, next);
+        if(blk == NULL) {
+            h->compact_cursor = 0;
+            return -1;
+        }
+        budget = (budget > size)?budget - size:0;
+    }
+
+    if(blk < last) {
+        h->compact_cursor = blkOffset(h, blk);
+        return 0;
+    }
+
+    h->compact_cursor = 0;
+    heap_trim(h, 0);
+    return 1;
+}
+
+/* ==================================================================================
+ * |                   Functions below are public interfaces                        |
+ * ==================================================================================
+ */
+
+/*
+ * Create a heap of at most max_size bytes (default reservation if 0):
+ * 
+ * 1. Map the heap state outside of any heap (port_map_meta).
+ * 2. Reserve the address space of the heap (see port_open_reserve),
+ *    pages are only committed as the heap grows.
+ * 3. Initialize the heap and link it into heap_list.
+ */
+mm_heap_t * mm_heap_create(size_t max_size) {
+    mm_heap_t * h = port_map_meta(sizeof(mm_heap_t));
+    if(h == NULL) {
+        error("Unable to map heap state");
+        return NULL;
+    }
+    mm_heap_t initial = HEAP_INITIALIZER;
+    *h = initial;
+    pthread_mutex_init(&h->lock, NULL);
+
+    if(port_open_reserve(&h->port, max_size) != 0) {
+        port_unmap_meta(h, sizeof(mm_heap_t));
+        return NULL;
+    }
+    if(mm_initialize(h) != 0) {
+        port_close(&h->port);
+        port_unmap_meta(h, sizeof(mm_heap_t));
+        return NULL;
+    }
+
+    pthread_mutex_lock(&heap_list_lock);
+    h->next = default_heap.next;
+    __atomic_store_n(&default_heap.next, h, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&heap_list_lock);
+
+    debug("Heap %p created: start=%p, reserved=%ld", h, port_get_mem_pool_start(&h->port), h->port.reserved);
+    return h;
+}
+
+/*
+ * Release every block of heap h at once, blocks are not walked.
+ * 
+ * Queued deferred frees are drained first, their links are stored in 
+ * the blocks, which are unmapped with the heap.
+ */
+int mm_heap_destroy(mm_heap_t * h) {
+    if(h == NULL || h == &default_heap) {
+        error("Default heap could not be destroyed");
+        return -1;
+    }
+
+    free_drain();
+
+    pthread_mutex_lock(&heap_list_lock);
+    mm_heap_t * prev = &default_heap;
+    while(prev->next != NULL && prev->next != h) {
+        prev = prev->next;
+    }
+    if(prev->next != h) {
+        pthread_mutex_unlock(&heap_list_lock);
+        error("Unknown heap %p", h);
+        return -1;
+    }
+    __atomic_store_n(&prev->next, h->next, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&heap_list_lock);
+
+    // Lookups which may still hold h (see heap_lookup)
+    while(__atomic_load_n(&heap_list_readers, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+
+    // Blocks are not walked, drop the samples of the heap at once
+    if(h->flag_inited) {
+        profile_retire_range(port_get_mem_pool_start(&h->port), port_get_mem_pool_end(&h->port));
+    }
+    for(int i = 0; i < 10; i++) {
+        free_index_release(&h->free_index[i]);
+    }
+    if(h->handles != NULL) {
+        port_unmap_meta(h->handles, h->handle_capacity*sizeof(handle_entry_t));
+    }
+    int ret = port_close(&h->port);
+    pthread_mutex_destroy(&h->lock);
+    port_unmap_meta(h, sizeof(mm_heap_t));
+
+    return ret;
+}
+
+/*
+ * Return the heap used by my_malloc
+ */
+mm_heap_t * mm_heap_default(void) {
+    return &default_heap;
+}
+
+/*
+ * Allocate size bytes from heap h (see heap_malloc)
+ */
+PROFILE_SECTION void * mm_heap_malloc(mm_heap_t * h, size_t size) {
+    heapLock(h);
+    void * ptr = heap_malloc(h, size);
+    purge_if_due(h);
+    heapUnlock(h);
+    return ptr;
+}
+
+/*
+ * Return a block to heap h (see heap_free)
+ */
+int mm_heap_free(mm_heap_t * h, void * ptr) {
+    heapLock(h);
+    int ret = heap_free(h, ptr);
+    purge_if_due(h);
+    heapUnlock(h);
+    return ret;
+}
+
+/*
+ * Return a block of size bytes (as requested) to heap h (see heap_free_sized)
+ */
+int mm_heap_free_sized(mm_heap_t * h, void * ptr, size_t size) {
+    heapLock(h);
+    int ret = heap_free_sized(h, ptr, size);
+    purge_if_due(h);
+    heapUnlock(h);
+    return ret;
+}
+
+/*
+ * Just implementation of malloc(n_elements*element_size)
+ * 
+ */
+PROFILE_SECTION void * mm_heap_calloc(mm_heap_t * h, size_t n_elements, size_t element_size) {
+    if(n_elements == 0 || element_size == 0)
+        return NULL;
+    if(element_size <= (SIZE_MAX/n_elements))
+        return mm_heap_malloc(h, n_elements*element_size);
+    else // Overflow
+        return NULL;   
+}
+
+/*
+ * Resize a block of heap h (see heap_realloc)
+ */
+PROFILE_SECTION void * mm_heap_realloc(mm_heap_t * h, void * p, size_t size) {
+    heapLock(h);
+    void * ptr = heap_realloc(h, p, size);
+    heapUnlock(h);
+    return ptr;
+}
+
+/*
+ * Release the free space at the end of heap h (see heap_trim)
+ */
+int mm_heap_trim(mm_heap_t * h, size_t pad) {
+    heapLock(h);
+    int ret = heap_trim(h, pad);
+    heapUnlock(h);
+    return ret;
+}
+
+/*
+ * Back the heap with transparent huge pages
+ */
+int mm_heap_set_huge_page(mm_heap_t * h, int enable) {
+    heapLock(h);
+    int ret = port_set_huge_page(&h->port, enable);
+    heapUnlock(h);
+
+    if(ret != 0) {
+        warn("Huge pages unavailable, using %ld byte pages", PAGE_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Select the placement policy of heap h (MM_POLICY_*)
+ */
+int mm_heap_set_policy(mm_heap_t * h, int policy) {
+    if(policy < 0 || policy >= MM_POLICY_COUNT) {
+        error("Unknown policy %d", policy);
+        return -1;
+    }
+
+    heapLock(h);
+    h->policy = policy;
+    for(int i = 0; i < 10; i++) {
+        h->free_index[i].rover = 0;
+    }
+    heapUnlock(h);
+    return 0;
+}
+
+/*
+ * Return the placement policy of heap h
+ */
+int mm_heap_get_policy(mm_heap_t * h) {
+    if(h->policy < 0) {
+        resolve_policy(h);
+    }
+    return h->policy;
+}
+
+/*
+ * Fill stats with the requests served by each policy of heap h
+ */
+int mm_heap_policy_stats(mm_heap_t * h, my_policy_stats_t * stats) {
+    if(h == NULL || stats == NULL) {
+        return -1;
+    }
+    heapLock(h);
+    *stats = h->policy_stats;
+    heapUnlock(h);
+    return 0;
+}
+
+/*
+ * Purge free blocks of heap h once they stay free for decay_ms ms,
+ * never if decay_ms is negative.
+ */
+int mm_heap_set_purge_decay(mm_heap_t * h, long decay_ms) {
+    heapLock(h);
+    h->purge_decay = decay_ms;
+    h->next_purge = 0;
+    heapUnlock(h);
+    return 0;
+}
+
+/*
+ * Purge every free block of heap h now, regardless of decay
+ */
+int mm_heap_purge(mm_heap_t * h) {
+    heapLock(h);
+    if(h->flag_inited) {
+        heap_purge(h, port_time_ms(), 1);
+    }
+    heapUnlock(h);
+    return 0;
+}
+
+/*
+ * Pre-warm heap h with bytes of resident free space, split as profile
+ */
+int mm_heap_reserve(mm_heap_t * h, size_t bytes, const my_reserve_class_t * profile) {
+    heapLock(h);
+    int ret = heap_reserve(h, bytes, profile);
+    heapUnlock(h);
+    return ret;
+}
+
+/*
+ * Limit heap h to soft / hard bytes (0 for no limit), see Memory Budget
+ */
+int mm_heap_set_budget(mm_heap_t * h, size_t soft, size_t hard) {
+    if(soft != 0 && hard != 0 && soft > hard) {
+        error("Soft limit %ld above hard limit %ld", soft, hard);
+        return -1;
+    }
+
+    heapLock(h);
+    h->budget_soft = soft;
+    h->budget_hard = hard;
+    heapUnlock(h);
+    return 0;
+}
+
+/*
+ * Register fn to be called with arg under budget pressure of heap h
+ */
+int mm_heap_add_reclaim(mm_heap_t * h, my_reclaim_t fn, void * arg) {
+    if(fn == NULL) {
+        return -1;
+    }
+
+    heapLock(h);
+    if(h->reclaim_count == MM_MAX_RECLAIMS) {
+        heapUnlock(h);
+        error("Too many reclaim callbacks");
+        return -1;
+    }
+    h->reclaims[h->reclaim_count].fn = fn;
+    h->reclaims[h->reclaim_count].arg = arg;
+    h->reclaim_count++;
+    heapUnlock(h);
+    return 0;
+}
+
+int mm_heap_remove_reclaim(mm_heap_t * h, my_reclaim_t fn, void * arg) {
+    int ret = -1;
+
+    heapLock(h);
+    for(size_t i = 0; i < h->reclaim_count; i++) {
+        if(h->reclaims[i].fn == fn && h->reclaims[i].arg == arg) {
+            memmove(&h->reclaims[i], &h->reclaims[i + 1], (h->reclaim_count - i - 1)*sizeof(reclaim_entry_t));
+            h->reclaim_count--;
+            ret = 0;
+            break;
+        }
+    }
+    heapUnlock(h);
+    return ret;
+}
+
+int mm_heap_budget_stats(mm_heap_t * h, my_budget_stats_t * stats) {
+    if(stats == NULL) {
+        return -1;
+    }
+
+    heapLock(h);
+    *stats = h->budget_stats;
+    stats->committed = port_get_mem_pool_end(&h->port) - port_get_mem_pool_start(&h->port);
+    stats->soft_limit = h->budget_soft;
+    stats->hard_limit = h->budget_hard;
+    heapUnlock(h);
+    return 0;
+}
+
+/*
+ * Allocate a movable block of size bytes from heap h, return its handle
+ * or 0 on failure. The block is found with mm_heap_hlock.
+ */
+PROFILE_SECTION my_handle_t mm_heap_halloc(mm_heap_t * h, size_t size) {
+    if(size > SIZE_MAX - HANDLE_PREFIX) {
+        return 0;
+    }
+
+    heapLock(h);
+    void * ptr = heap_malloc(h, size + HANDLE_PREFIX);
+    if(ptr == NULL) {
+        heapUnlock(h);
+        return 0;
+    }
+    size_t handle = handle_new(h);
+    if(handle == 0) {
+        error("Unable to grow handle table");
+        heap_free(h, ptr);
+        heapUnlock(h);
+        return 0;
+    }
+
+    mem_list_t * blk = ptr - 2*SIZE_HorF;
+    blk->header = blk->header | MOVABLE_FLAG;
+    *(tag_t *)((void *)blk + getBlkSize(blk) + 2*SIZE_HorF) = blk->header ^ magic_byte();
+
+    *(size_t *)ptr = handle;
+    h->handles[handle - 1].ptr = ptr + HANDLE_PREFIX;
+    h->handles[handle - 1].locks = 0;
+    purge_if_due(h);
+    heapUnlock(h);
+
+    return handle;
+}
+
+/*
+ * Pin the block of handle and return its address, valid until the 
+ * matching mm_heap_hunlock. Locks nest.
+ */
+void * mm_heap_hlock(mm_heap_t * h, my_handle_t handle) {
+    heapLock(h);
+    handle_entry_t * entry = handle_entry(h, handle);
+    if(entry == NULL) {
+        heapUnlock(h);
+        error("Invalid handle %ld", handle);
+        return NULL;
+    }
+    entry->locks++;
+    void * ptr = entry->ptr;
+    heapUnlock(h);
+
+    return ptr;
+}
+
+int mm_heap_hunlock(mm_heap_t * h, my_handle_t handle) {
+    heapLock(h);
+    handle_entry_t * entry = handle_entry(h, handle);
+    if(entry == NULL || entry->locks == 0) {
+        heapUnlock(h);
+        error("Handle %ld is not locked", handle);
+        return -1;
+    }
+    entry->locks--;
+    heapUnlock(h);
+
+    return 0;
+}
+
+/*
+ * Free the block of handle, which must not be locked
+ */
+int mm_heap_hfree(mm_heap_t * h, my_handle_t handle) {
+    heapLock(h);
+    handle_entry_t * entry = handle_entry(h, handle);
+    if(entry == NULL || entry->locks != 0) {
+        heapUnlock(h);
+        error("Handle %ld is invalid or locked", handle);
+        return -1;
+    }
+
+    int ret = heap_free(h, entry->ptr - HANDLE_PREFIX);
+    entry->ptr = NULL;
+    entry->next_free = h->handle_free;
+    h->handle_free = handle;
+    purge_if_due(h);
+    heapUnlock(h);
+
+    return ret;
+}
+
+/*
+ * Run the compactor on heap h for about budget bytes (see heap_compact_step)
+ */
+int mm_heap_compact_step(mm_heap_t * h, size_t budget) {
+    heapLock(h);
+    int ret = heap_compact_step(h, budget);
+    heapUnlock(h);
+    return ret;
+}
+
+/*
+ * Functions below work on the default heap, my_free and my_realloc take
+ * blocks of any heap.
+ */
+PROFILE_SECTION void * my_malloc(size_t size) {
+    return mm_heap_malloc(&default_heap, size);
+}
+
+/*
+ * Return the heap of a lifetime class, the default heap if it could not
+ * be created
+ */
+static mm_heap_t * lifetime_heap(int lifetime) {
+    mm_heap_t * h = __atomic_load_n(&lifetime_heaps[lifetime], __ATOMIC_ACQUIRE);
+    if(h != NULL || lifetime == MM_LONG_LIVED) {
+        return (h != NULL)?h:&default_heap;
+    }
+
+    pthread_mutex_lock(&lifetime_lock);
+    h = lifetime_heaps[lifetime];
+    if(h == NULL) {
+        h = mm_heap_create(0);
+        if(h == NULL) {
+            warn("Unable to create heap of lifetime %d, using default heap", lifetime);
+            h = &default_heap;
+        }
+        __atomic_store_n(&lifetime_heaps[lifetime], h, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&lifetime_lock);
+
+    return h;
+}
+
+PROFILE_SECTION void * my_malloc_hint(size_t size, int lifetime) {
+    if(lifetime < 0 || lifetime >= MM_LIFETIME_COUNT) {
+        error("Unknown lifetime %d", lifetime);
+        return NULL;
+    }
+    return mm_heap_malloc(lifetime_heap(lifetime), size);
+}
+
+int my_free(void * ptr) {
+    mm_heap_t * h = heap_lookup(ptr);
+    if(h == NULL) {
+        error("Invalid address!");
+        return -1;
+    }
+    int ret = mm_heap_free(h, ptr);
+    heap_unlookup(h);
+    return ret;
+}
+
+int my_free_sized(void * ptr, size_t size) {
+    mm_heap_t * h = heap_lookup(ptr);
+    if(h == NULL) {
+        error("Invalid address!");
+        return -1;
+    }
+    int ret = mm_heap_free_sized(h, ptr, size);
+    heap_unlookup(h);
+    return ret;
+}
+
+PROFILE_SECTION void * my_calloc(size_t n_elements, size_t element_size) {
+    return mm_heap_calloc(&default_heap, n_elements, element_size);
+}
+
+PROFILE_SECTION void * my_realloc(void * p, size_t size) {
+    if(p == NULL) {
+        return my_malloc(size);
+    }
+    mm_heap_t * h = heap_lookup(p);
+    if(h == NULL) {
+        error("Invalid address!");
+        return NULL;
+    }
+    void * ptr = mm_heap_realloc(h, p, size);
+    heap_unlookup(h);
+    return ptr;
+}
+
+int my_trim(size_t pad) {
+    int ret = mm_heap_trim(&default_heap, pad);
+    for(int i = 0; i < MM_LIFETIME_COUNT; i++) {
+        mm_heap_t * h = __atomic_load_n(&lifetime_heaps[i], __ATOMIC_ACQUIRE);
+        if(h != NULL && h != &default_heap && mm_heap_trim(h, 0) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+int my_reserve(size_t bytes, const my_reserve_class_t * profile) {
+    return mm_heap_reserve(&default_heap, bytes, profile);
+}
+
+int my_set_budget(size_t soft, size_t hard) {
+    return mm_heap_set_budget(&default_heap, soft, hard);
+}
+
+int my_add_reclaim(my_reclaim_t fn, void * arg) {
+    return mm_heap_add_reclaim(&default_heap, fn, arg);
+}
+
+int my_remove_reclaim(my_reclaim_t fn, void * arg) {
+    return mm_heap_remove_reclaim(&default_heap, fn, arg);
+}
+
+int my_budget_stats(my_budget_stats_t * stats) {
+    return mm_heap_budget_stats(&default_heap, stats);
+}
+
+PROFILE_SECTION my_handle_t my_halloc(size_t size) {
+    return mm_heap_halloc(&default_heap, size);
+}
+
+void * my_hlock(my_handle_t handle) {
+    return mm_heap_hlock(&default_heap, handle);
+}
+
+int my_hunlock(my_handle_t handle) {
+    return mm_heap_hunlock(&default_heap, handle);
+}
+
+int my_hfree(my_handle_t handle) {
+    return mm_heap_hfree(&default_heap, handle);
+}
+
+int my_compact_step(size_t budget) {
+    return mm_heap_compact_step(&default_heap, budget);
+}
+
+int my_set_huge_page(int enable) {
+    return mm_heap_set_huge_page(&default_heap, enable);
+}
+
+int my_set_policy(int policy) {
+    return mm_heap_set_policy(&default_heap, policy);
+}
+
+int my_get_policy(void) {
+    return mm_heap_get_policy(&default_heap);
+}
+
+const char * my_policy_name(int policy) {
+    if(policy < 0 || policy >= MM_POLICY_COUNT) {
+        return NULL;
+    }
+    return policy_names[policy];
+}
+
+int my_policy_stats(my_policy_stats_t * stats) {
+    return mm_heap_policy_stats(&default_heap, stats);
+}
+
+int my_set_purge_decay(long decay_ms) {
+    return mm_heap_set_purge_decay(&default_heap, decay_ms);
+}
+
+int my_purge(void) {
+    for(int i = 0; i < MM_LIFETIME_COUNT; i++) {
+        mm_heap_t * h = __atomic_load_n(&lifetime_heaps[i], __ATOMIC_ACQUIRE);
+        if(h != NULL && h != &default_heap) {
+            mm_heap_purge(h);
+        }
+    }
+    return mm_heap_purge(&default_heap);
+}
+
+/*
+ * Background purging:
+ * 
+ * Every half of the shortest decay, the purge thread purges every heap
+ * in heap_list whose blocks decayed. Purging is not done in my_malloc
+ * and my_free while the thread runs.
+ */
+static void * purge_thread_main(void * arg) {
+    pthread_mutex_lock(&purge_thread_lock);
+    while(__atomic_load_n(&purge_thread_running, __ATOMIC_ACQUIRE)) {
+        long interval = PURGE_DEFAULT_DECAY/2;
+
+        pthread_mutex_lock(&heap_list_lock);
+        size_t now = port_time_ms();
+        for(mm_heap_t * h = heap_list; h != NULL; h = h->next) {
+            pthread_mutex_lock(&h->lock);
+            if(h->flag_inited && h->purge_decay >= 0) {
+                heap_purge(h, now, 0);
+                if(h->purge_decay/2 < interval) {
+                    interval = h->purge_decay/2;
+                }
+            }
+            pthread_mutex_unlock(&h->lock);
+        }
+        pthread_mutex_unlock(&heap_list_lock);
+
+        if(interval < PURGE_THREAD_MIN_INTERVAL) {
+            interval = PURGE_THREAD_MIN_INTERVAL;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval/1000;
+        deadline.tv_nsec += (interval%1000)*1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&purge_thread_cond, &purge_thread_lock, &deadline);
+    }
+    pthread_mutex_unlock(&purge_thread_lock);
+
+    return NULL;
+}
+
+/*
+ * Start (enable = 1) or stop (enable = 0) the background purge thread.
+ * 
+ * Heaps are locked by their public functions while the thread runs. It
+ * must be called when no other thread uses the allocator.
+ */
+int my_purge_thread(int enable) {
+    if(enable && !__atomic_load_n(&purge_thread_running, __ATOMIC_ACQUIRE)) {
+        __atomic_add_fetch(&background_threads, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&purge_thread_running, 1, __ATOMIC_RELEASE);
+        if(pthread_create(&purge_thread, NULL, purge_thread_main, NULL) != 0) {
+            error("Unable to start purge thread");
+            __atomic_store_n(&purge_thread_running, 0, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&background_threads, 1, __ATOMIC_RELEASE);
+            return -1;
+        }
+    }
+    else if(!enable && __atomic_load_n(&purge_thread_running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&purge_thread_lock);
+        __atomic_store_n(&purge_thread_running, 0, __ATOMIC_RELEASE);
+        pthread_cond_signal(&purge_thread_cond);
+        pthread_mutex_unlock(&purge_thread_lock);
+
+        pthread_join(purge_thread, NULL);
+        __atomic_sub_fetch(&background_threads, 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * Queue a block to be freed later by the reclaimer thread, only the 
+ * allocated bit is checked here.
+ */
+int my_free_deferred(void * ptr) {
+    mem_list_t * blk = ptr - 2*SIZE_HorF;
+
+    if(ptr == NULL || ((size_t)ptr & alignMask) != 0 || (blk->header & 0x1) == 0 || (blk->header & MOVABLE_FLAG) != 0) {
+        error("Invalid address!");
+        return -1;
+    }
+
+    deferred_free_t * entry = ptr;
+    deferred_free_t * head = __atomic_load_n(&deferred_head, __ATOMIC_RELAXED);
+    do {
+        if(head == NULL) {
+            __atomic_store_n(&deferred_since, port_time_ms(), __ATOMIC_RELAXED);
+        }
+        entry->next = head;
+    } while(!__atomic_compare_exchange_n(&deferred_head, &head, entry, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if(__atomic_add_fetch(&deferred_depth, 1, __ATOMIC_RELAXED) == DEFERRED_FREE_BATCH && __atomic_load_n(&reclaim_thread_running, __ATOMIC_ACQUIRE)) {
+        pthread_cond_signal(&reclaim_thread_cond);
+    }
+    return 0;
+}
+
+/*
+ * Deferred Free Procedure:
+ * 
+ * 1. Take every queued block at once, reverse them into queue order.
+ * 2. Free them with heap_free, consecutive blocks of a heap are freed
+ *    under one lock of the heap.
+ * 3. Record the lag of the oldest block.
+ * 
+ * Return the number of blocks taken from the queue.
+ */
+static size_t free_drain(void) {
+    pthread_mutex_lock(&deferred_lock);
+    deferred_free_t * stack = __atomic_exchange_n(&deferred_head, NULL, __ATOMIC_ACQUIRE);
+    if(stack == NULL) {
+        pthread_mutex_unlock(&deferred_lock);
+        return 0;
+    }
+
+    deferred_free_t * queue = NULL;
+    while(stack != NULL) {
+        deferred_free_t * next = stack->next;
+        stack->next = queue;
+        queue = stack;
+        stack = next;
+    }
+    size_t lag = port_time_ms() - __atomic_load_n(&deferred_since, __ATOMIC_RELAXED);
+
+    size_t count = 0;
+    mm_heap_t * locked = NULL;
+    pthread_mutex_lock(&heap_list_lock);
+    while(queue != NULL) {
+        deferred_free_t * next = queue->next;
+        mm_heap_t * h = heap_of_locked(queue);
+        if(h != locked) {
+            if(locked != NULL) {
+                heapUnlock(locked);
+            }
+            locked = h;
+            if(locked != NULL) {
+                heapLock(locked);
+            }
+        }
+        if(h == NULL || heap_free(h, queue) != 0) {
+            error("Deferred free of %p failed", queue);
+            deferred_stats.failed++;
+        }
+        count++;
+        queue = next;
+    }
+    if(locked != NULL) {
+        heapUnlock(locked);
+    }
+    pthread_mutex_unlock(&heap_list_lock);
+
+    __atomic_sub_fetch(&deferred_depth, count, __ATOMIC_RELAXED);
+    deferred_stats.reclaimed += count;
+    deferred_stats.batches++;
+    deferred_stats.last_lag_ms = lag;
+    if(lag > deferred_stats.max_lag_ms) {
+        deferred_stats.max_lag_ms = lag;
+    }
+    pthread_mutex_unlock(&deferred_lock);
+
+    debug("Drained %ld deferred block(s), lag %ld ms", count, lag);
+    return count;
+}
+
+/*
+ * Free every queued block now, e.g. under memory pressure
+ */
+int my_free_drain(void) {
+    return free_drain();
+}
+
+int my_deferred_stats(my_deferred_stats_t * stats) {
+    if(stats == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&deferred_lock);
+    *stats = deferred_stats;
+    pthread_mutex_unlock(&deferred_lock);
+    stats->depth = __atomic_load_n(&deferred_depth, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static void * reclaim_thread_main(void * arg) {
+    pthread_mutex_lock(&reclaim_thread_lock);
+    while(__atomic_load_n(&reclaim_thread_running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&reclaim_thread_lock);
+        free_drain();
+        pthread_mutex_lock(&reclaim_thread_lock);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += DEFERRED_FREE_INTERVAL*1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if(__atomic_load_n(&reclaim_thread_running, __ATOMIC_ACQUIRE)) {
+            pthread_cond_timedwait(&reclaim_thread_cond, &reclaim_thread_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&reclaim_thread_lock);
+
+    // Nothing is left behind once stopped
+    free_drain();
+    return NULL;
+}
+
+/*
+ * Start (enable = 1) or stop (enable = 0) the reclaimer thread, which 
+ * frees the blocks queued by my_free_deferred.
+ * 
+ * Like my_purge_thread, heaps are locked while it runs, and it must be
+ * called when no other thread uses the allocator.
+ */
+int my_reclaim_thread(int enable) {
+    if(enable && !__atomic_load_n(&reclaim_thread_running, __ATOMIC_ACQUIRE)) {
+        __atomic_add_fetch(&background_threads, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&reclaim_thread_running, 1, __ATOMIC_RELEASE);
+        if(pthread_create(&reclaim_thread, NULL, reclaim_thread_main, NULL) != 0) {
+            error("Unable to start reclaimer thread");
+            __atomic_store_n(&reclaim_thread_running, 0, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&background_threads, 1, __ATOMIC_RELEASE);
+            return -1;
+        }
+    }
+    else if(!enable && __atomic_load_n(&reclaim_thread_running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&reclaim_thread_lock);
+        __atomic_store_n(&reclaim_thread_running, 0, __ATOMIC_RELEASE);
+        pthread_cond_signal(&reclaim_thread_cond);
+        pthread_mutex_unlock(&reclaim_thread_lock);
+
+        pthread_join(reclaim_thread, NULL);
+        __atomic_sub_fetch(&background_threads, 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * Open a file-backed heap:
+ * 
+ * 1. Map the heap file (see port_open_file), a new file starts an 
+ *    empty heap.
+ * 2. For an existing heap, check it was closed cleanly, restore the
+ *    free list heads and rebuild the free indexes from the free lists,
+ *    oldest block first. The free time of a purge state was taken in the
+ *    previous run (see port_time_ms, relative to boot), it is reset to
+ *    now, so the decay starts over.
+ * 3. Mark the heap dirty until my_persist_close.
+ * 
+ * Blocks are never walked, so reopening costs the mapping plus one pass
+ * over the free blocks.
+ */
+int my_persist_open(const char * path, size_t max_size) {
+    mm_heap_t * h = &default_heap;
+
+    if(h->flag_inited) {
+        error("Heap already initialized");
+        return -1;
+    }
+
+    int existing = port_open_file(&h->port, path, max_size);
+    if(existing < 0) {
+        return -1;
+    }
+    h->persist = port_get_persist_area(&h->port);
+
+    if(!existing) {
+        memset(h->persist, 0, sizeof(mm_persist_t));
+        h->persist->magic = PERSIST_MAGIC;
+        if(mm_initialize(h) != 0) {
+            h->persist = NULL;
+            port_close(&h->port);
+            return -1;
+        }
+        return 0;
+    }
+
+    if(h->persist->magic != PERSIST_MAGIC || h->persist->clean != 1) {
+        error("%s was not closed cleanly", path);
+        h->persist = NULL;
+        port_close(&h->port);
+        return -1;
+    }
+
+    size_t now = port_time_ms();
+    for(int i = 0; i < 10; i++) {
+        h->free_list[i] = linkBlk(h, h->persist->free_list[i]);
+        mem_list_t * tail = h->free_list[i];
+        while(tail != NULL && tail->next != 0) {
+            tail = linkBlk(h, tail->next);
+        }
+        // From the tail, so the newest block of h->free_list[0] is indexed last
+        for(mem_list_t * blk = tail; blk != NULL; blk = linkBlk(h, blk->prev)) {
+            free_index_insert(&h->free_index[i], getBlkSize(blk), blkOffset(h, blk));
+            purge_state_t * state = purgeState(blk);
+            if(state != NULL) {
+                state->freed_at = now;
+            }
+        }
+    }
+
+    h->persist->clean = 0;
+    h->compact_cursor = 0;
+    resolve_policy(h);
+    h->flag_inited = 1;
+
+    debug("Reopened %s, heap: start=%p, end=%p", path, port_get_mem_pool_start(&h->port), port_get_mem_pool_end(&h->port));
+    return 0;
+}
+
+/*
+ * Close the file-backed heap, every block stays in the file.
+ */
+int my_persist_close(void) {
+    mm_heap_t * h = &default_heap;
+
+    if(h->persist == NULL) {
+        error("Heap is not file-backed");
+        return -1;
+    }
+
+    // Links of queued blocks are in the file, which is unmapped
+    free_drain();
+
+    // Background threads must not walk the lists while they are torn down
+    heapLock(h);
+    for(int i = 0; i < 10; i++) {
+        h->persist->free_list[i] = blkLink(h, h->free_list[i]);
+        h->free_list[i] = NULL;
+        free_index_release(&h->free_index[i]);
+    }
+    h->persist->clean = 1;
+
+    h->persist = NULL;
+    h->flag_inited = 0;
+    h->compact_cursor = 0;
+    int ret = port_close(&h->port);
+    heapUnlock(h);
+
+    return ret;
+}
+
+/*
+ * Record root as the root object of the file-backed heap
+ */
+int my_persist_set_root(void * root) {
+    mm_heap_t * h = &default_heap;
+
+    if(h->persist == NULL) {
+        error("Heap is not file-backed");
+        return -1;
+    }
+    if(root != NULL && (root < port_get_mem_pool_start(&h->port) || root >= port_get_mem_pool_end(&h->port))) {
+        error("Root %p is not in heap", root);
+        return -1;
+    }
+
+    h->persist->root = (root == NULL)?0:(size_t)(root - port_get_mem_pool_start(&h->port));
+    return 0;
+}
+
+/*
+ * Return the root object of the file-backed heap
+ */
+void * my_persist_get_root(void) {
+    mm_heap_t * h = &default_heap;
+
+    if(h->persist == NULL || h->persist->root == 0) {
+        return NULL;
+    }
+    return port_get_mem_pool_start(&h->port) + h->persist->root;
+}
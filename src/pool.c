@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "debug.h"
+#include "mm.h"
+#include "port.h"
+#include "profile.h"
+
+/*
+ * Pool Chunk Map
+ *
+ * -------------------------------------------------------------------- <- returned by chunk alloc
+ * |                 Next chunk of the same pool                      |
+ * --------------------------------------------------------------------
+ * |              Size of chunk (given to chunk free)                 |
+ * --------------------------------------------------------------------
+ * |                   Number of slots in chunk                       |
+ * --------------------------------------------------------------------
+ * |                 padding (up to pool alignment)                   |
+ * -------------------------------------------------------------------- <- aligned
+ * |                            Slot 0                                |
+ * --------------------------------------------------------------------
+ * |                              ...                                 |
+ * --------------------------------------------------------------------
+ * |                          Slot (n - 1)                            |
+ * --------------------------------------------------------------------
+ *
+ * Slots are carved from the newest chunk with a bump pointer, so a
+ * chunk is never touched before its slots are actually used. A freed
+ * slot stores the address of the next free slot in its first word.
+ */
+
+#define POOL_DEFAULT_ALIGN  MM_ALIGNMENT
+#define POOL_MIN_SLOTS      8
+#define POOL_MAX_CHUNK      (1024*1024)
+
+typedef struct pool_chunk {
+    struct pool_chunk * next;
+    size_t size;
+    size_t slots;
+}pool_chunk_t;
+
+struct my_pool {
+    size_t obj_size;
+    size_t slot_size;
+    size_t align;
+    size_t next_chunk_size;     // Bytes requested for the next chunk
+    void * free_slot;           // Head of the intrusive free list
+    void * bump;                // Next uncarved slot in newest chunk
+    void * bump_end;            // End of newest chunk
+    pool_chunk_t * chunks;
+    my_pool_chunk_ops_t ops;    // Chunk allocator
+    my_pool_stats_t stats;
+};
+
+#define roundUp(size, align) (((size) + (align) - 1) & ~((align) - 1))
+
+/*
+ * Default chunk allocator, the heap of my_malloc
+ */
+PROFILE_SECTION static void * heap_chunk_alloc(size_t size, void * arg) {
+    return my_malloc(size);
+}
+
+static int heap_chunk_free(void * chunk, size_t size, void * arg) {
+    return my_free(chunk);
+}
+
+static const my_pool_chunk_ops_t heap_chunk_ops = {
+    heap_chunk_alloc, heap_chunk_free, NULL
+};
+
+/*
+ * Get a new chunk from the chunk allocator and make it the carving chunk
+ */
+PROFILE_SECTION static int pool_grow(my_pool_t * pool) {
+    size_t header_size = roundUp(sizeof(pool_chunk_t), pool->align);
+    size_t chunk_size = pool->next_chunk_size;
+
+    // Chunks are only aligned to POOL_DEFAULT_ALIGN, reserve room for the rest
+    if(pool->align > POOL_DEFAULT_ALIGN) {
+        chunk_size += pool->align - POOL_DEFAULT_ALIGN;
+    }
+
+    pool_chunk_t * chunk = pool->ops.alloc(chunk_size, pool->ops.arg);
+    if(chunk == NULL) {
+        error("Unable to grow pool %p", pool);
+        return -1;
+    }
+    chunk->size = chunk_size;
+
+    void * first_slot = (void *)roundUp((size_t)chunk + header_size, pool->align);
+    chunk->slots = ((void *)chunk + chunk_size - first_slot) / pool->slot_size;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+
+    pool->bump = first_slot;
+    pool->bump_end = first_slot + chunk->slots*pool->slot_size;
+
+    pool->stats.chunk_count++;
+    pool->stats.chunk_bytes += chunk_size;
+
+    debug("Pool %p grown by %ld slots@%p", pool, chunk->slots, first_slot);
+
+    // Chunks grow geometrically to keep the number of chunks logarithmic
+    if(2*pool->next_chunk_size <= POOL_MAX_CHUNK) {
+        pool->next_chunk_size = 2*pool->next_chunk_size;
+    }
+
+    return 0;
+}
+
+/*
+ * Check if ptr is a slot of pool, only used in debug build
+ */
+static int pool_owns(my_pool_t * pool, void * ptr) {
+    size_t header_size = roundUp(sizeof(pool_chunk_t), pool->align);
+
+    for(pool_chunk_t * chunk = pool->chunks; chunk != NULL; chunk = chunk->next) {
+        void * first_slot = (void *)roundUp((size_t)chunk + header_size, pool->align);
+        void * last_slot = first_slot + chunk->slots*pool->slot_size;
+        if(ptr >= first_slot && ptr < last_slot) {
+            return ((size_t)(ptr - first_slot) % pool->slot_size) == 0;
+        }
+    }
+
+    return 0;
+}
+
+/* ==================================================================================
+ * |                   Functions below are public interfaces                        |
+ * ==================================================================================
+ */
+
+/*
+ * Create a pool of obj_size objects aligned to align bytes.
+ * align must be 0 (default alignment of my_malloc) or a power of two.
+ */
+PROFILE_SECTION my_pool_t * my_pool_create(size_t obj_size, size_t align) {
+    return my_pool_create_with(obj_size, align, &heap_chunk_ops);
+}
+
+/*
+ * Create a pool like my_pool_create, whose chunks are obtained from ops
+ * (the heap of my_malloc if NULL).
+ */
+PROFILE_SECTION my_pool_t * my_pool_create_with(size_t obj_size, size_t align, const my_pool_chunk_ops_t * ops) {
+    if(ops == NULL) {
+        ops = &heap_chunk_ops;
+    }
+    if(ops->alloc == NULL || ops->free == NULL) {
+        error("Incomplete pool chunk allocator");
+        return NULL;
+    }
+
+    if(obj_size == 0) {
+        error("Zero-size pool");
+        return NULL;
+    }
+
+    if(align == 0) {
+        align = POOL_DEFAULT_ALIGN;
+    }
+    if((align & (align - 1)) != 0) {
+        error("Pool alignment %ld is not a power of two", align);
+        return NULL;
+    }
+    // Free slots store the free list link
+    if(align < sizeof(void *)) {
+        align = sizeof(void *);
+    }
+    if(obj_size > POOL_MAX_CHUNK) {
+        error("Object size %ld too large for pool", obj_size);
+        return NULL;
+    }
+
+    my_pool_t * pool = my_malloc(sizeof(my_pool_t));
+    if(pool == NULL) {
+        return NULL;
+    }
+
+    pool->obj_size = obj_size;
+    pool->slot_size = roundUp((obj_size < sizeof(void *))?sizeof(void *):obj_size, align);
+    pool->align = align;
+    pool->free_slot = NULL;
+    pool->bump = NULL;
+    pool->bump_end = NULL;
+    pool->chunks = NULL;
+    pool->ops = *ops;
+
+    // First chunk holds at least POOL_MIN_SLOTS slots, or one page worth of slots
+    pool->next_chunk_size = roundUp(sizeof(pool_chunk_t), align) + POOL_MIN_SLOTS*pool->slot_size;
+    if(pool->next_chunk_size < (size_t)PAGE_SIZE) {
+        pool->next_chunk_size = PAGE_SIZE;
+    }
+
+    memset(&pool->stats, 0, sizeof(my_pool_stats_t));
+    pool->stats.obj_size = obj_size;
+    pool->stats.slot_size = pool->slot_size;
+
+    debug("Pool %p created: obj_size=%ld, slot_size=%ld, align=%ld", pool, obj_size, pool->slot_size, align);
+
+    return pool;
+}
+
+/*
+ * Take one slot from the pool, grow the pool by one chunk if necessary.
+ *
+ * 1. Pop the free list if it is not empty.
+ * 2. Otherwise carve the next slot of the newest chunk.
+ * 3. Get a new chunk if the newest chunk is used up.
+ */
+PROFILE_SECTION void * my_pool_alloc(my_pool_t * pool) {
+    void * slot = pool->free_slot;
+
+    if(slot != NULL) {
+        pool->free_slot = *(void **)slot;
+    }
+    else {
+        if(pool->bump == pool->bump_end && pool_grow(pool) != 0) {
+            return NULL;
+        }
+        slot = pool->bump;
+        pool->bump += pool->slot_size;
+        pool->stats.slots_total++;
+    }
+
+    pool->stats.slots_in_use++;
+    if(pool->stats.slots_in_use > pool->stats.slots_high_water) {
+        pool->stats.slots_high_water = pool->stats.slots_in_use;
+        pool->stats.bytes_high_water = pool->stats.slots_high_water*pool->slot_size;
+    }
+
+    return slot;
+}
+
+/*
+ * Return one slot to the pool by pushing it onto the free list.
+ */
+int my_pool_free(my_pool_t * pool, void * ptr) {
+    if(ptr == NULL || ((size_t)ptr & (pool->align - 1)) != 0) {
+        error("Invalid address!");
+        return -1;
+    }
+
+#ifdef DEBUG
+    if(!pool_owns(pool, ptr)) {
+        error("%p is not a slot of pool %p", ptr, pool);
+        return -1;
+    }
+#endif
+
+    *(void **)ptr = pool->free_slot;
+    pool->free_slot = ptr;
+    pool->stats.slots_in_use--;
+
+    return 0;
+}
+
+/*
+ * Release every chunk of the pool, and the pool itself.
+ */
+int my_pool_destroy(my_pool_t * pool) {
+    pool_chunk_t * chunk = pool->chunks;
+
+    debug("Destroying pool %p, %ld slot(s) still in use", pool, pool->stats.slots_in_use);
+
+    while(chunk != NULL) {
+        pool_chunk_t * next = chunk->next;
+        if(pool->ops.free(chunk, chunk->size, pool->ops.arg) != 0) {
+            error("Unable to release chunk %p", chunk);
+            return -1;
+        }
+        chunk = next;
+    }
+
+    return my_free(pool);
+}
+
+/*
+ * Fill stats with the current statistics of the pool.
+ */
+int my_pool_stats(my_pool_t * pool, my_pool_stats_t * stats) {
+    if(pool == NULL || stats == NULL) {
+        return -1;
+    }
+    *stats = pool->stats;
+    return 0;
+}
@@ -1,92 +1,630 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "port.h"
 #include "debug.h"
 
 /*
- * To simplify the implementation, brk() is perfered rather than
- * mmap(), for mmap would not guarantee providing a contiguous page
- * address space, which means that you must store the data cross
- * different memory address region, page assign infomation must be 
- * recorded to make sure there's no unlawful memory access. 
+ * The heap must be a contiguous address space, so that boundary tags of
+ * adjacent blocks could be coalesced. brk() provides that, but any other
+ * library moving the program break (malloc() in standard C library, for
+ * one) breaks the heap, and mmap() would not guarantee the next pages
+ * are adjacent to the heap.
+ * 
+ * Instead, the address space of the largest heap is reserved at once
+ * (PROT_NONE, no memory committed), then pages of the reservation are
+ * committed with mprotect() as the heap grows. Other mappings never 
+ * land inside the reservation, and growing the heap is a protection
+ * change.
+ * 
+ * The reservation of a heap without a backend is made on its first 
+ * extension, DEFAULT_RESERVE_SIZE bytes unless RESERVE_SIZE_ENV is set.
  */
 
-static int init_status = 0;
-static void * current_heap_start = NULL;
-static void * current_heap_end = NULL;
+/*
+ * Heap File Map (file backend, see port_open_file)
+ * 
+ * -------------------------------------------------------------------- <- Offset 0, reservation start
+ * |                   port_file_header_t                             |
+ * --------------------------------------------------------------------
+ * |        Persist area (owned by memory manager, see mm.c)          |
+ * -------------------------------------------------------------------- <- Offset PAGE_SIZE, heap start
+ * |                                                                  |
+ * |                          Heap pages                              |
+ * |                                                                  |
+ * -------------------------------------------------------------------- <- Heap end
+ * |           Reserved address space (PROT_NONE, not in file)        |
+ * -------------------------------------------------------------------- <- Reservation end
+ * 
+ * The contiguous problem of mmap() is solved by reserving the address
+ * space of the largest heap at once, the file is then mapped over the
+ * reservation with MAP_FIXED page by page as the heap grows.
+ */
+
+#define PORT_FILE_MAGIC     ((uint64_t)0x50414548454c4946) // "FILEHEAP"
+#define PORT_FILE_HEADER    256
+
+typedef struct port_file_header {
+    uint64_t magic;
+    uint64_t page_size;
+    uint64_t base;              // Address of the header when last mapped
+    uint64_t heap_size;         // Bytes of heap pages after the header page
+    uint64_t max_size;          // Bytes of heap pages reserved
+}port_file_header_t;
+
+static long huge_page_size = -1;
 
 /*
  * Return the start of heap (accessable from the return address)
  * 
  */
-void * port_get_mem_pool_start(void) {
-    return current_heap_start;
+void * port_get_mem_pool_start(port_t * port) {
+    return port->heap_start;
 }
 
 /*
  * Return the end of heap (not accessable from the return address)
  * 
  */
-void * port_get_mem_pool_end(void) {
-    return current_heap_end;
+void * port_get_mem_pool_end(port_t * port) {
+    return port->heap_end;
+}
+
+/*
+ * Ask the kernel to back [start, end) with transparent huge pages.
+ * 
+ * madvise() only accepts page aligned ranges, the kernel would use huge
+ * pages for every huge page aligned part inside the range.
+ */
+static void advise_huge_page(void * start, void * end) {
+    size_t page_mask = PAGE_SIZE - 1;
+    void * aligned_start = (void *)(((size_t)start + page_mask) & ~page_mask);
+    void * aligned_end = (void *)((size_t)end & ~page_mask);
+
+    if(aligned_end <= aligned_start) {
+        return;
+    }
+
+    if(madvise(aligned_start, aligned_end - aligned_start, MADV_HUGEPAGE) != 0) {
+        warn("madvise(MADV_HUGEPAGE) failed on %p-%p", aligned_start, aligned_end);
+    }
 }
 
 /*
- * Extend heap n pages (mmap version, but not finished due to address contiguous problem)
+ * Read a small sysfs file without stdio (stdio buffers are malloc()ed)
  */
+static ssize_t read_sys_file(const char * path, char * buf, size_t len) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+
+    ssize_t n = read(fd, buf, len - 1);
+    close(fd);
+    if(n < 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
 /*
-int port_extend_page(int count) {
-    if(init_status == 0) {
-        current_heap_start = mmap(NULL, count*PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if(MAP_FAILED == current_heap_start) {
-            error("mmap failed!");
-            return -1;
+ * Reserve size bytes of address space, at addr if possible, otherwise
+ * at an address aligned to align bytes (a power of two, or 0).
+ * 
+ * The alignment is made by reserving align bytes more, then unmapping
+ * the unaligned head and the tail.
+ */
+static void * reserve_address_space(void * addr, size_t size, size_t align) {
+    void * base = MAP_FAILED;
+
+    if(addr != NULL) {
+        base = mmap(addr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+        if(MAP_FAILED != base) {
+            return base;
         }
-        current_heap_end = current_heap_start + count*PAGE_SIZE;
-        debug("Heap: start=%p, end=%p", current_heap_start, current_heap_end);
-        init_status = 1;
-        return 0;
     }
 
-    debug("requesting %d pages from %p", count, current_heap_end);
+    if(align > (size_t)PAGE_SIZE) {
+        base = mmap(NULL, size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(MAP_FAILED != base) {
+            void * aligned = (void *)(((size_t)base + align - 1) & ~(align - 1));
+            if(aligned != base) {
+                munmap(base, aligned - base);
+            }
+            munmap(aligned + size, base + align - aligned);
+            return aligned;
+        }
+    }
+
+    base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(MAP_FAILED == base) {
+        error("Unable to reserve %ld bytes", size);
+        return NULL;
+    }
+
+    return base;
+}
+
+/*
+ * Return the reservation size of a heap without backend: RESERVE_SIZE_ENV
+ * in bytes (suffix K, M, G or T allowed), or DEFAULT_RESERVE_SIZE.
+ */
+static size_t default_reserve_size(void) {
+    const char * env = getenv(RESERVE_SIZE_ENV);
+    if(env == NULL) {
+        return DEFAULT_RESERVE_SIZE;
+    }
+
+    char * unit;
+    errno = 0;
+    size_t size = strtoull(env, &unit, 10);
+    int shift = 0;
+    switch(*unit) {
+        case 't': case 'T': shift += 10;
+        /* fall through */
+        case 'g': case 'G': shift += 10;
+        /* fall through */
+        case 'm': case 'M': shift += 10;
+        /* fall through */
+        case 'k': case 'K': shift += 10;
+        /* fall through */
+        default: break;
+    }
+
+    // Too large for size_t, once in bytes
+    if(errno == ERANGE || size > (SIZE_MAX >> shift)) {
+        warn("%s=%s overflows, reserving %ld bytes", RESERVE_SIZE_ENV, env, (size_t)DEFAULT_RESERVE_SIZE);
+        return DEFAULT_RESERVE_SIZE;
+    }
+    size <<= shift;
+
+    if(size < (size_t)PAGE_SIZE) {
+        warn("Invalid %s=%s, reserving %ld bytes", RESERVE_SIZE_ENV, env, (size_t)DEFAULT_RESERVE_SIZE);
+        return DEFAULT_RESERVE_SIZE;
+    }
+    return size;
+}
+
+/*
+ * Extend heap n pages from heap_end (file version)
+ */
+static int file_extend_page(port_t * port, int count) {
+    port_file_header_t * file_header = port->reservation;
+    size_t heap_size = port->heap_end - port->heap_start + count*PAGE_SIZE;
+
+    debug("requesting %d pages from %p", count, port->heap_end);
+
+    if(PAGE_SIZE + heap_size > port->reserved) {
+        error("Heap file reservation exhausted");
+        return -1;
+    }
+
+    if(ftruncate(port->file_fd, PAGE_SIZE + heap_size) != 0) {
+        error("ftruncate failed!");
+        return -1;
+    }
 
-    void * addr = mmap(current_heap_end, count*PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void * addr = mmap(port->heap_end, count*PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, port->file_fd, PAGE_SIZE + (port->heap_end - port->heap_start));
     if(MAP_FAILED == addr) {
         error("mmap failed!");
         return -1;
     }
-    
-    current_heap_end += count*PAGE_SIZE;
 
-    if(addr != current_heap_end-count*PAGE_SIZE) {
-        error("mmap returned %p, but expect %p", addr, current_heap_end);
+    port->heap_end += count*PAGE_SIZE;
+    file_header->heap_size = heap_size;
+    port->init_status = 1;
+
+    debug("Heap: start=%p, end=%p", port->heap_start, port->heap_end);
+    return 0;
+}
+
+/*
+ * Extend heap n pages from heap_end (reserve version)
+ */
+static int reserve_extend_page(port_t * port, int count) {
+    debug("requesting %d pages from %p", count, port->heap_end);
+
+    if((size_t)(port->heap_end - port->heap_start) + count*PAGE_SIZE > port->reserved) {
+        error("Heap reservation exhausted");
+        return -1;
+    }
+
+    if(mprotect(port->heap_end, count*PAGE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        error("mprotect failed!");
+        return -1;
+    }
+
+    if(port->huge_page) {
+        advise_huge_page(port->heap_end, port->heap_end + count*PAGE_SIZE);
+    }
+
+    port->heap_end += count*PAGE_SIZE;
+    port->init_status = 1;
+
+    debug("Heap: start=%p, end=%p", port->heap_start, port->heap_end);
+    return 0;
+}
+
+/*
+ * Give n pages before heap_end back to the reservation
+ */
+static int unmap_shrink_page(port_t * port, int count) {
+    void * new_end = port->heap_end - count*PAGE_SIZE;
+
+    // Replacing the pages drops them and their commit charge
+    void * addr = mmap(new_end, count*PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    if(MAP_FAILED == addr) {
+        error("mmap failed!");
         return -1;
     }
 
-    debug("Heap: start=%p, end=%p", current_heap_start, current_heap_end);
+    port->heap_end = new_end;
+
+    if(port->backend == PORT_BACKEND_FILE) {
+        port_file_header_t * file_header = port->reservation;
+        file_header->heap_size = port->heap_end - port->heap_start;
+        if(ftruncate(port->file_fd, PAGE_SIZE + file_header->heap_size) != 0) {
+            warn("ftruncate failed, heap file not shrunk");
+        }
+    }
+
+    debug("Heap: start=%p, end=%p", port->heap_start, port->heap_end);
     return 0;
 }
-*/
 
 /*
- * Extend heap n pages from current_heap_end (brk version)
+ * Extend heap n pages from heap_end, a heap without backend reserves
+ * the default address space first.
  */
-int port_extend_page(int count) {
-    if(init_status == 0) {
-        current_heap_start = sbrk(count*PAGE_SIZE);
-        current_heap_end = current_heap_start + count*PAGE_SIZE;
-        debug("Heap: start=%p, end=%p", current_heap_start, current_heap_end);
-        init_status = 1;
+int port_extend_page(port_t * port, int count) {
+    if(port->backend == PORT_BACKEND_NONE && port_open_reserve(port, 0) != 0) {
+        return -1;
+    }
+    if(port->backend == PORT_BACKEND_FILE) {
+        return file_extend_page(port, count);
+    }
+    return reserve_extend_page(port, count);
+}
+
+/*
+ * Shrink heap n pages from heap_end
+ */
+int port_shrink_page(port_t * port, int count) {
+    if(port->init_status == 0 || port->heap_end - count*PAGE_SIZE <= port->heap_start) {
+        error("Unable to shrink %d pages", count);
+        return -1;
+    }
+
+    debug("releasing %d pages before %p", count, port->heap_end);
+
+    return unmap_shrink_page(port, count);
+}
+
+/*
+ * Return the transparent huge page size, or 0 if huge pages are unsupported
+ * 
+ * THP is considered unsupported if it is disabled system-wide ("[never]"),
+ * both "[always]" and "[madvise]" modes honour MADV_HUGEPAGE.
+ */
+size_t port_huge_page_size(void) {
+    char buf[64];
+
+    if(huge_page_size >= 0) {
+        return huge_page_size;
+    }
+
+    huge_page_size = 0;
+    if(read_sys_file("/sys/kernel/mm/transparent_hugepage/enabled", buf, sizeof(buf)) < 0 ||
+        strstr(buf, "[never]") != NULL) {
+        info("Transparent huge pages unavailable");
+        return huge_page_size;
+    }
+
+    huge_page_size = DEFAULT_HUGE_PAGE_SIZE;
+    if(read_sys_file("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", buf, sizeof(buf)) > 0) {
+        long size = strtol(buf, NULL, 10);
+        if(size > 0 && (size % PAGE_SIZE) == 0) {
+            huge_page_size = size;
+        }
+    }
+
+    return huge_page_size;
+}
+
+/*
+ * Enable or disable transparent huge pages for the heap
+ */
+int port_set_huge_page(port_t * port, int enable) {
+    if(enable && port_huge_page_size() == 0) {
+        port->huge_page = 0;
+        return -1;
+    }
+
+    // Pages already in the heap are advised as well
+    if(enable && !port->huge_page && port->init_status != 0) {
+        advise_huge_page(port->heap_start, port->heap_end);
+    }
+
+    port->huge_page = enable;
+    return 0;
+}
+
+/*
+ * Return 1 if the heap is backed by transparent huge pages
+ */
+int port_get_huge_page(port_t * port) {
+    return port->huge_page;
+}
+
+/*
+ * Release the physical pages of [addr, addr + size) to the system
+ * 
+ * MADV_DONTNEED (rather than MADV_FREE) drops the pages at once, so they
+ * are known to read as zero afterwards. The memory manager relies on 
+ * that to skip zeroing purged pages of a new block.
+ */
+int port_purge_page(port_t * port, void * addr, size_t size) {
+    if(port->backend != PORT_BACKEND_RESERVE) {
+        return -1;
+    }
+
+    if(madvise(addr, size, MADV_DONTNEED) != 0) {
+        warn("madvise(MADV_DONTNEED) failed on %p-%p", addr, addr + size);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Fault in the pages of [addr, addr + size) (page aligned) for writing
+ * 
+ * MADV_POPULATE_WRITE (Linux 5.14) faults the whole range in one system
+ * call. Older kernels reject it, every page is then touched with an 
+ * atomic add of zero, a write access which keeps the contents and does
+ * not map the zero page first.
+ */
+int port_populate_page(port_t * port, void * addr, size_t size) {
+    if(port->init_status == 0) {
+        return -1;
+    }
+
+#ifdef MADV_POPULATE_WRITE
+    if(madvise(addr, size, MADV_POPULATE_WRITE) == 0) {
         return 0;
     }
+    debug("madvise(MADV_POPULATE_WRITE) failed on %p-%p, touching pages", addr, addr + size);
+#endif
 
-    debug("requesting %d pages from %p", count, current_heap_end);
+    for(size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        __atomic_fetch_add((char *)addr + offset, 0, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
 
-    current_heap_end += count*PAGE_SIZE;
+/*
+ * Return a monotonic time in milliseconds (coarse clock, no system call)
+ */
+size_t port_time_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/*
+ * Map memory outside of heap for allocator metadata (page granularity)
+ */
+void * port_map_meta(size_t size) {
+    void * addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == addr) {
+        error("mmap failed!");
+        return NULL;
+    }
+    return addr;
+}
+
+/*
+ * Resize metadata mapped by port_map_meta, the mapping may move
+ */
+void * port_remap_meta(void * addr, size_t old_size, size_t new_size) {
+    void * new_addr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+    if(MAP_FAILED == new_addr) {
+        error("mremap failed!");
+        return NULL;
+    }
+    return new_addr;
+}
 
-    if(0 != brk(current_heap_end)) {
-        error("sbrk failed!");
+/*
+ * Unmap metadata mapped by port_map_meta
+ */
+int port_unmap_meta(void * addr, size_t size) {
+    if(munmap(addr, size) != 0) {
+        error("munmap failed!");
         return -1;
     }
-    
-    debug("Heap: start=%p, end=%p", current_heap_start, current_heap_end);
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Use the file at path as heap, create it if it does not exist
+ * 
+ * 1. Read the header of an existing file, check it's a heap file.
+ * 2. Reserve the address space of max_size bytes of heap (at least the
+ *    size of last mapping, the default reservation if 0), at the 
+ *    address of last mapping if possible.
+ * 3. Map the header page and the existing heap pages over the reservation.
+ * 
+ * Return 1 if the file contains a heap, 0 if the heap is empty.
+ */
+int port_open_file(port_t * port, const char * path, size_t max_size) {
+    struct stat st;
+    port_file_header_t header;
+
+    if(port->init_status != 0 || port->backend != PORT_BACKEND_NONE) {
+        error("Heap already in use");
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        error("Unable to open %s", path);
+        if(fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(port_file_header_t));
+    if(st.st_size > 0) {
+        if(pread(fd, &header, sizeof(port_file_header_t), 0) != sizeof(port_file_header_t) ||
+            header.magic != PORT_FILE_MAGIC || header.page_size != (uint64_t)PAGE_SIZE ||
+            PAGE_SIZE + header.heap_size > (uint64_t)st.st_size) {
+            error("%s is not a heap file", path);
+            close(fd);
+            return -1;
+        }
+        if(header.max_size > max_size) {
+            max_size = header.max_size;
+        }
+    }
+    else if(ftruncate(fd, PAGE_SIZE) != 0) {
+        error("ftruncate failed!");
+        close(fd);
+        return -1;
+    }
+
+    if(max_size == 0) {
+        max_size = default_reserve_size();
+    }
+    if(max_size > MAX_RESERVE_SIZE) {
+        warn("Heap limited to %ld bytes", MAX_RESERVE_SIZE);
+        max_size = MAX_RESERVE_SIZE;
+    }
+    max_size = (max_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    size_t reserved = PAGE_SIZE + max_size;
+
+    void * base = reserve_address_space((void *)header.base, reserved, 0);
+    if(base == NULL) {
+        close(fd);
+        return -1;
+    }
+    if(header.base != 0 && base != (void *)header.base) {
+        warn("Heap file mapped at %p instead of %p", base, (void *)header.base);
+    }
+
+    if(MAP_FAILED == mmap(base, PAGE_SIZE + header.heap_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)) {
+        error("mmap failed!");
+        munmap(base, reserved);
+        close(fd);
+        return -1;
+    }
+
+    port_file_header_t * file_header = base;
+    file_header->magic = PORT_FILE_MAGIC;
+    file_header->page_size = PAGE_SIZE;
+    file_header->base = (uint64_t)base;
+    file_header->heap_size = header.heap_size;
+    file_header->max_size = max_size;
+
+    port->backend = PORT_BACKEND_FILE;
+    port->file_fd = fd;
+    port->reservation = base;
+    port->reserved = reserved;
+    port->heap_start = base + PAGE_SIZE;
+    port->heap_end = port->heap_start + header.heap_size;
+    port->init_status = (header.heap_size != 0);
+
+    debug("Heap file %s: start=%p, end=%p, reserved=%ld", path, port->heap_start, port->heap_end, reserved);
+    return port->init_status;
+}
+
+/*
+ * Reserve max_size bytes (the default reservation size if 0) of address
+ * space as heap, pages are committed with mprotect() by port_extend_page.
+ * 
+ * The reservation is aligned to the huge page size, so a heap ending on
+ * a huge page boundary is made of whole huge pages.
+ */
+int port_open_reserve(port_t * port, size_t max_size) {
+    if(port->init_status != 0 || port->backend != PORT_BACKEND_NONE) {
+        error("Heap already in use");
+        return -1;
+    }
+
+    if(max_size == 0) {
+        max_size = default_reserve_size();
+    }
+    if(max_size > MAX_RESERVE_SIZE) {
+        warn("Heap limited to %ld bytes", MAX_RESERVE_SIZE);
+        max_size = MAX_RESERVE_SIZE;
+    }
+    max_size = (max_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    size_t align = port_huge_page_size();
+    void * base = reserve_address_space(NULL, max_size, (align != 0)?align:DEFAULT_HUGE_PAGE_SIZE);
+    if(base == NULL) {
+        return -1;
+    }
+
+    port->backend = PORT_BACKEND_RESERVE;
+    port->reservation = base;
+    port->reserved = max_size;
+    port->heap_start = base;
+    port->heap_end = base;
+
+    debug("Heap reserved: start=%p, reserved=%ld", port->heap_start, max_size);
+    return 0;
+}
+
+/*
+ * Release every page of the heap at once, a heap file is written back
+ * first. The port is reset to a heap without backend.
+ */
+int port_close(port_t * port) {
+    int ret = 0;
+
+    if(port->backend == PORT_BACKEND_NONE) {
+        error("Heap not in use");
+        return -1;
+    }
+
+    if(port->backend == PORT_BACKEND_FILE) {
+        port_file_header_t * file_header = port->reservation;
+        if(msync(file_header, PAGE_SIZE + file_header->heap_size, MS_SYNC) != 0) {
+            error("msync failed!");
+            ret = -1;
+        }
+        close(port->file_fd);
+    }
+
+    if(munmap(port->reservation, port->reserved) != 0) {
+        error("munmap failed!");
+        ret = -1;
+    }
+
+    port_t initial = PORT_INITIALIZER;
+    *port = initial;
+
+    return ret;
+}
+
+/*
+ * Return the area of the heap file header kept for the memory manager,
+ * or NULL if the heap is not file-backed.
+ */
+void * port_get_persist_area(port_t * port) {
+    if(port->backend != PORT_BACKEND_FILE) {
+        return NULL;
+    }
+    return port->reservation + PORT_FILE_HEADER;
+}
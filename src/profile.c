@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <execinfo.h>
+
+#include "debug.h"
+#include "mm.h"
+#include "port.h"
+#include "profile.h"
+
+/*
+ * Sampling:
+ * 
+ * Allocations are sampled as a Poisson process over the allocated bytes,
+ * the bytes between two samples are drawn from an exponential distribution
+ * of mean rate. Every byte has the same 1/rate chance to be sampled, so a
+ * large allocation is more likely sampled than a small one, and pprof 
+ * could estimate the real usage from the samples (heap_v2).
+ * 
+ * With sampling off, profile_countdown is reset to PROFILE_IDLE_INTERVAL
+ * bytes, so a new rate is seen by every thread after at most that many
+ * bytes allocated.
+ * 
+ * Tables (meta memory, see port_map_meta):
+ * 
+ * samples | ptr | size | stack | ...      Live samples, by block address
+ * stacks  | frames | counters  | ...      One entry per allocation site
+ * sites   | stack + 1 | ...                Index of stacks, by stack hash
+ * 
+ * Both hash tables use linear probing, and stay at most half full.
+ */
+
+#define PROFILE_IDLE_INTERVAL   ((ssize_t)64*1024*1024)
+#define PROFILE_INITIAL_SLOTS   1024
+
+typedef struct profile_sample {
+    void * ptr;                 // NULL if the slot is empty
+    size_t size;
+    size_t stack;
+}profile_sample_t;
+
+typedef struct profile_stack {
+    uint64_t hash;
+    int depth;
+    void * frames[PROFILE_MAX_DEPTH];
+    size_t live_count;
+    size_t live_bytes;
+    size_t alloc_count;
+    size_t alloc_bytes;
+}profile_stack_t;
+
+__thread ssize_t profile_countdown = 0;
+static __thread uint64_t random_state = 0;
+
+static size_t sample_rate = 0;
+
+/*
+ * Bounds of PROFILE_SECTION, set by the linker, NULL if not supported
+ */
+extern char __start_mm_alloc_text[] __attribute__((weak));
+extern char __stop_mm_alloc_text[] __attribute__((weak));
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static profile_sample_t * samples = NULL;
+static size_t sample_count = 0;
+static size_t sample_capacity = 0;
+
+static profile_stack_t * stacks = NULL;
+static size_t stack_count = 0;
+static size_t stack_capacity = 0;
+
+static size_t * sites = NULL;
+static size_t site_capacity = 0;
+
+static size_t hash_ptr(void * ptr) {
+    return ((size_t)ptr >> 4) * 0x9e3779b97f4a7c15;
+}
+
+static uint64_t hash_frames(void ** frames, int depth) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for(int i = 0; i < depth; i++) {
+        hash = (hash ^ (uint64_t)frames[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+/*
+ * Draw the bytes until the next sample, exponentially distributed
+ */
+static ssize_t next_interval(size_t rate) {
+    // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    uint64_t bits = random_state * 0x2545f4914f6cdd1d;
+
+    // Uniform in (0, 1]
+    double u = ((bits >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double interval = -log(u) * rate;
+
+    if(interval < 1) {
+        return 1;
+    }
+    return (interval < PROFILE_IDLE_INTERVAL*16.0)?(ssize_t)interval:PROFILE_IDLE_INTERVAL*16;
+}
+
+/*
+ * Return the stack entry of frames, add it if not found
+ */
+static ssize_t find_stack(void ** frames, int depth) {
+    uint64_t hash = hash_frames(frames, depth);
+
+    if(2*(stack_count + 1) > site_capacity) {
+        size_t capacity = (site_capacity == 0)?PROFILE_INITIAL_SLOTS:2*site_capacity;
+        size_t * new_sites = port_map_meta(capacity*sizeof(size_t));
+        if(new_sites == NULL) {
+            return -1;
+        }
+        for(size_t i = 0; i < stack_count; i++) {
+            size_t slot = stacks[i].hash & (capacity - 1);
+            while(new_sites[slot] != 0) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            new_sites[slot] = i + 1;
+        }
+        if(sites != NULL) {
+            port_unmap_meta(sites, site_capacity*sizeof(size_t));
+        }
+        sites = new_sites;
+        site_capacity = capacity;
+    }
+
+    size_t slot = hash & (site_capacity - 1);
+    while(sites[slot] != 0) {
+        profile_stack_t * stack = &stacks[sites[slot] - 1];
+        if(stack->hash == hash && stack->depth == depth && memcmp(stack->frames, frames, depth*sizeof(void *)) == 0) {
+            return sites[slot] - 1;
+        }
+        slot = (slot + 1) & (site_capacity - 1);
+    }
+
+    if(stack_count == stack_capacity) {
+        size_t capacity = (stack_capacity == 0)?PROFILE_INITIAL_SLOTS:2*stack_capacity;
+        profile_stack_t * new_stacks;
+        if(stacks == NULL) {
+            new_stacks = port_map_meta(capacity*sizeof(profile_stack_t));
+        }
+        else {
+            new_stacks = port_remap_meta(stacks, stack_capacity*sizeof(profile_stack_t), capacity*sizeof(profile_stack_t));
+        }
+        if(new_stacks == NULL) {
+            return -1;
+        }
+        stacks = new_stacks;
+        stack_capacity = capacity;
+    }
+
+    profile_stack_t * stack = &stacks[stack_count];
+    memset(stack, 0, sizeof(profile_stack_t));
+    stack->hash = hash;
+    stack->depth = depth;
+    memcpy(stack->frames, frames, depth*sizeof(void *));
+    sites[slot] = ++stack_count;
+
+    return stack_count - 1;
+}
+
+/*
+ * Add a live sample, growing the table if necessary
+ */
+static int add_sample(void * ptr, size_t size, size_t stack) {
+    if(2*(sample_count + 1) > sample_capacity) {
+        size_t capacity = (sample_capacity == 0)?PROFILE_INITIAL_SLOTS:2*sample_capacity;
+        profile_sample_t * new_samples = port_map_meta(capacity*sizeof(profile_sample_t));
+        if(new_samples == NULL) {
+            return -1;
+        }
+        for(size_t i = 0; i < sample_capacity; i++) {
+            if(samples[i].ptr == NULL) {
+                continue;
+            }
+            size_t slot = hash_ptr(samples[i].ptr) & (capacity - 1);
+            while(new_samples[slot].ptr != NULL) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            new_samples[slot] = samples[i];
+        }
+        if(samples != NULL) {
+            port_unmap_meta(samples, sample_capacity*sizeof(profile_sample_t));
+        }
+        samples = new_samples;
+        sample_capacity = capacity;
+    }
+
+    size_t slot = hash_ptr(ptr) & (sample_capacity - 1);
+    while(samples[slot].ptr != NULL) {
+        slot = (slot + 1) & (sample_capacity - 1);
+    }
+    samples[slot].ptr = ptr;
+    samples[slot].size = size;
+    samples[slot].stack = stack;
+    sample_count++;
+
+    return 0;
+}
+
+/*
+ * Remove the sample in slot, moving back the following entries which
+ * could no longer be found past the hole.
+ */
+static void delete_sample(size_t slot) {
+    size_t mask = sample_capacity - 1;
+
+    for(;;) {
+        samples[slot].ptr = NULL;
+        size_t next = slot;
+        for(;;) {
+            next = (next + 1) & mask;
+            if(samples[next].ptr == NULL) {
+                sample_count--;
+                return;
+            }
+            size_t home = hash_ptr(samples[next].ptr) & mask;
+            // Entry stays if its home slot is cyclically in (slot, next]
+            if((slot <= next)?(slot < home && home <= next):(slot < home || home <= next)) {
+                continue;
+            }
+            break;
+        }
+        samples[slot] = samples[next];
+        slot = next;
+    }
+}
+
+PROFILE_SECTION int profile_sample(void * ptr, size_t size) {
+    size_t rate = sample_rate;
+
+    if(rate == 0) {
+        profile_countdown = PROFILE_IDLE_INTERVAL;
+        return -1;
+    }
+    if(random_state == 0) {
+        // First sample of this thread, start at a random point
+        random_state = ((uint64_t)(size_t)&random_state ^ ((uint64_t)port_time_ms() << 32)) | 1;
+        profile_countdown = next_interval(rate);
+        return -1;
+    }
+    profile_countdown = next_interval(rate);
+
+    void * frames[PROFILE_SKIP_MAX + PROFILE_MAX_DEPTH];
+    int depth = backtrace(frames, PROFILE_SKIP_MAX + PROFILE_MAX_DEPTH);
+    int skip = 1;
+
+    // Skip the frames of the allocator, profile_sample at least
+    while(skip < depth && (char *)frames[skip] >= __start_mm_alloc_text && (char *)frames[skip] < __stop_mm_alloc_text) {
+        skip++;
+    }
+    if(depth - skip > PROFILE_MAX_DEPTH) {
+        depth = skip + PROFILE_MAX_DEPTH;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+    ssize_t stack = find_stack(frames + skip, depth - skip);
+    if(stack < 0 || add_sample(ptr, size, stack) != 0) {
+        pthread_mutex_unlock(&profile_lock);
+        warn("Sample of %p dropped", ptr);
+        return -1;
+    }
+    stacks[stack].live_count++;
+    stacks[stack].live_bytes += size;
+    stacks[stack].alloc_count++;
+    stacks[stack].alloc_bytes += size;
+    pthread_mutex_unlock(&profile_lock);
+
+    return 0;
+}
+
+int profile_retire(void * ptr) {
+    pthread_mutex_lock(&profile_lock);
+
+    if(sample_capacity != 0) {
+        size_t slot = hash_ptr(ptr) & (sample_capacity - 1);
+        while(samples[slot].ptr != NULL) {
+            if(samples[slot].ptr == ptr) {
+                stacks[samples[slot].stack].live_count--;
+                stacks[samples[slot].stack].live_bytes -= samples[slot].size;
+                delete_sample(slot);
+                pthread_mutex_unlock(&profile_lock);
+                return 0;
+            }
+            slot = (slot + 1) & (sample_capacity - 1);
+        }
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+    return -1;
+}
+
+int profile_move(void * old_ptr, void * new_ptr) {
+    pthread_mutex_lock(&profile_lock);
+
+    if(sample_capacity != 0) {
+        size_t slot = hash_ptr(old_ptr) & (sample_capacity - 1);
+        while(samples[slot].ptr != NULL) {
+            if(samples[slot].ptr == old_ptr) {
+                profile_sample_t sample = samples[slot];
+                delete_sample(slot);
+                int ret = add_sample(new_ptr, sample.size, sample.stack);
+                if(ret != 0) {
+                    stacks[sample.stack].live_count--;
+                    stacks[sample.stack].live_bytes -= sample.size;
+                }
+                pthread_mutex_unlock(&profile_lock);
+                return ret;
+            }
+            slot = (slot + 1) & (sample_capacity - 1);
+        }
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+    return -1;
+}
+
+/*
+ * Entries moved back by delete_sample land in the slot just emptied or
+ * in slots not scanned yet, so the slot is checked again after a delete.
+ */
+size_t profile_retire_range(void * start, void * end) {
+    size_t retired = 0;
+
+    pthread_mutex_lock(&profile_lock);
+
+    for(size_t slot = 0; slot < sample_capacity && sample_count != 0; ) {
+        void * ptr = samples[slot].ptr;
+        if(ptr != NULL && ptr >= start && ptr < end) {
+            stacks[samples[slot].stack].live_count--;
+            stacks[samples[slot].stack].live_bytes -= samples[slot].size;
+            delete_sample(slot);
+            retired++;
+        }
+        else {
+            slot++;
+        }
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+    return retired;
+}
+
+/* ==================================================================================
+ * |                   Functions below are public interfaces                        |
+ * ==================================================================================
+ */
+
+/*
+ * Sample about one allocation per rate bytes, 0 to stop sampling
+ */
+int my_profile_set_rate(size_t rate) {
+    pthread_mutex_lock(&profile_lock);
+    sample_rate = rate;
+    pthread_mutex_unlock(&profile_lock);
+
+    // Other threads see the new rate at their next sample
+    profile_countdown = 0;
+    return 0;
+}
+
+/*
+ * Write the heap profile to path, in the legacy heap profile format of
+ * gperftools (read by pprof):
+ * 
+ * heap profile: <live objs>: <live bytes> [<alloc objs>: <alloc bytes>] @ heap_v2/<rate>
+ * <live objs>: <live bytes> [<alloc objs>: <alloc bytes>] @ <pc> <pc> ...
+ * ...
+ * 
+ * MAPPED_LIBRARIES:
+ * <content of /proc/self/maps>
+ * 
+ * Counts are those of samples, pprof scales them by the sampling rate.
+ */
+int my_profile_dump(const char * path) {
+    FILE * file = fopen(path, "w");
+    if(file == NULL) {
+        error("Unable to open %s", path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for(size_t i = 0; i < stack_count; i++) {
+        live_count += stacks[i].live_count;
+        live_bytes += stacks[i].live_bytes;
+        alloc_count += stacks[i].alloc_count;
+        alloc_bytes += stacks[i].alloc_bytes;
+    }
+    fprintf(file, "heap profile: %6ld: %8ld [%6ld: %8ld] @ heap_v2/%ld\n", live_count, live_bytes, alloc_count, alloc_bytes, sample_rate);
+
+    for(size_t i = 0; i < stack_count; i++) {
+        profile_stack_t * stack = &stacks[i];
+        fprintf(file, "%6ld: %8ld [%6ld: %8ld] @", stack->live_count, stack->live_bytes, stack->alloc_count, stack->alloc_bytes);
+        for(int j = 0; j < stack->depth; j++) {
+            fprintf(file, " %p", stack->frames[j]);
+        }
+        fprintf(file, "\n");
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+
+    // pprof maps the addresses to binaries with the memory map
+    fprintf(file, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if(maps >= 0) {
+        char buf[4096];
+        ssize_t n;
+        while((n = read(maps, buf, sizeof(buf))) > 0) {
+            fwrite(buf, 1, n, file);
+        }
+        close(maps);
+    }
+
+    return (fclose(file) == 0)?0:-1;
+}
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "debug.h"
+#include "mm.h"
+#include "port.h"
+#include "trace.h"
+
+/*
+ * Rings:
+ *
+ * A ring is mapped by the first event of a thread, and linked in
+ * ring_list so rings of exited threads are still dumped. Only the owner
+ * thread writes its ring, head counts every event recorded, the event
+ * i is at i % TRACE_RING_EVENTS.
+ */
+typedef struct trace_ring {
+    trace_event_t events[TRACE_RING_EVENTS];
+    uint64_t head;
+    uint64_t tid;
+    struct trace_ring * next;
+}trace_ring_t;
+
+static __thread trace_ring_t * ring = NULL;
+static __thread int in_trace = 0;           // Set while mapping the ring, events are dropped
+
+static trace_ring_t * ring_list = NULL;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+// Calibration of the time stamp counter, taken with the first ring
+static uint64_t start_tsc = 0;
+static uint64_t start_ns = 0;
+
+static uint64_t read_tsc(void) {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+#endif
+}
+
+static uint64_t read_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+static void trace_dump_at_exit(void) {
+    my_trace_dump(getenv("MM_TRACE"));
+}
+
+static void trace_init(void) {
+    start_tsc = read_tsc();
+    start_ns = read_ns();
+    if(getenv("MM_TRACE") != NULL) {
+        atexit(trace_dump_at_exit);
+    }
+}
+
+static trace_ring_t * ring_new(void) {
+    pthread_once(&trace_once, trace_init);
+
+    in_trace = 1;
+    trace_ring_t * new_ring = port_map_meta(sizeof(trace_ring_t));
+    in_trace = 0;
+    if(new_ring == NULL) {
+        return NULL;
+    }
+    new_ring->tid = syscall(SYS_gettid);
+
+    pthread_mutex_lock(&ring_lock);
+    new_ring->next = ring_list;
+    ring_list = new_ring;
+    pthread_mutex_unlock(&ring_lock);
+
+    return new_ring;
+}
+
+/*
+ * Arguments were converted to uint64_t by the trace macro, the decoder
+ * narrows them again as told by the format.
+ */
+void trace_record(const trace_site_t * site, ...) {
+    if(ring == NULL) {
+        if(in_trace || (ring = ring_new()) == NULL) {
+            return;
+        }
+    }
+
+    trace_event_t * event = &ring->events[ring->head % TRACE_RING_EVENTS];
+    event->tsc = read_tsc();
+    event->site = (uint64_t)site;
+
+    va_list ap;
+    va_start(ap, site);
+    for(uint32_t i = 0; i < site->nargs; i++) {
+        event->args[i] = va_arg(ap, uint64_t);
+    }
+    va_end(ap);
+
+    ring->head++;
+}
+
+static int write_words(FILE * file, uint64_t * words, size_t count) {
+    return (fwrite(words, sizeof(uint64_t), count, file) == count)?0:-1;
+}
+
+static int write_string(FILE * file, const char * str) {
+    size_t len = strlen(str);
+    return (fwrite(str, 1, len, file) == len)?0:-1;
+}
+
+static int compare_sites(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* ==================================================================================
+ * |                   Functions below are public interfaces                        |
+ * ==================================================================================
+ */
+
+/*
+ * Write every ring (see Dump Layout in trace.h):
+ *
+ * 1. Collect the sites of every event kept, sorted and deduplicated.
+ * 2. Write the sites, then the events of every ring, oldest first.
+ *
+ * Rings should not be written by other threads meanwhile, their newest
+ * events could be torn.
+ */
+int my_trace_dump(const char * path) {
+    if(path == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    size_t event_count = 0;
+    size_t ring_count = 0;
+    for(trace_ring_t * r = ring_list; r != NULL; r = r->next) {
+        event_count += (r->head < TRACE_RING_EVENTS)?r->head:TRACE_RING_EVENTS;
+        ring_count++;
+    }
+
+    uint64_t * sites = NULL;
+    size_t site_count = 0;
+    if(event_count != 0) {
+        sites = port_map_meta(event_count*sizeof(uint64_t));
+        if(sites == NULL) {
+            pthread_mutex_unlock(&ring_lock);
+            return -1;
+        }
+    }
+    for(trace_ring_t * r = ring_list; r != NULL; r = r->next) {
+        uint64_t count = (r->head < TRACE_RING_EVENTS)?r->head:TRACE_RING_EVENTS;
+        for(uint64_t i = r->head - count; i < r->head; i++) {
+            sites[site_count++] = r->events[i % TRACE_RING_EVENTS].site;
+        }
+    }
+    if(site_count != 0) {
+        qsort(sites, site_count, sizeof(uint64_t), compare_sites);
+        size_t unique = 1;
+        for(size_t i = 1; i < site_count; i++) {
+            if(sites[i] != sites[unique - 1]) {
+                sites[unique++] = sites[i];
+            }
+        }
+        site_count = unique;
+    }
+
+    FILE * file = fopen(path, "w");
+    if(file == NULL) {
+        pthread_mutex_unlock(&ring_lock);
+        if(sites != NULL) {
+            port_unmap_meta(sites, event_count*sizeof(uint64_t));
+        }
+        return -1;
+    }
+
+    uint64_t elapsed_ns = read_ns() - start_ns;
+    uint64_t ticks_per_us = (elapsed_ns >= 1000)?(read_tsc() - start_tsc)/(elapsed_ns/1000):0;
+    uint64_t header[4] = {0, ticks_per_us, site_count, ring_count};
+    memcpy(header, TRACE_MAGIC, sizeof(uint64_t));
+    int ret = write_words(file, header, 4);
+
+    for(size_t i = 0; i < site_count && ret == 0; i++) {
+        const trace_site_t * site = (const trace_site_t *)sites[i];
+        uint64_t words[7] = {sites[i], site->level, site->line, site->nargs, strlen(site->file), strlen(site->func), strlen(site->fmt)};
+        ret = write_words(file, words, 7);
+        ret = (ret == 0)?write_string(file, site->file):ret;
+        ret = (ret == 0)?write_string(file, site->func):ret;
+        ret = (ret == 0)?write_string(file, site->fmt):ret;
+    }
+
+    for(trace_ring_t * r = ring_list; r != NULL && ret == 0; r = r->next) {
+        uint64_t count = (r->head < TRACE_RING_EVENTS)?r->head:TRACE_RING_EVENTS;
+        uint64_t words[2] = {r->tid, count};
+        ret = write_words(file, words, 2);
+        for(uint64_t i = r->head - count; i < r->head && ret == 0; i++) {
+            ret = (fwrite(&r->events[i % TRACE_RING_EVENTS], sizeof(trace_event_t), 1, file) == 1)?0:-1;
+        }
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    if(fclose(file) != 0) {
+        ret = -1;
+    }
+    if(sites != NULL) {
+        port_unmap_meta(sites, event_count*sizeof(uint64_t));
+    }
+    return ret;
+}
@@ -0,0 +1,219 @@
+/*
+ * Render a trace dump (see my_trace_dump) as text:
+ *
+ * usage: trace_decode <dump>
+ *
+ * Events of every thread are merged in time stamp order, one per line:
+ *
+ * <us since first event> <thread id> <LEVEL> <file>:<function>:<line> <message>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+
+typedef struct decoded_site {
+    uint64_t id;
+    uint64_t level;
+    uint64_t line;
+    uint64_t nargs;
+    char * file;
+    char * func;
+    char * fmt;
+}decoded_site_t;
+
+typedef struct decoded_event {
+    uint64_t tid;
+    trace_event_t event;
+}decoded_event_t;
+
+static const char * level_names[] = {"DEBUG", "INFO", "WARN", "SUCCESS", "ERROR"};
+
+static int read_words(FILE * file, uint64_t * words, size_t count) {
+    return (fread(words, sizeof(uint64_t), count, file) == count)?0:-1;
+}
+
+static char * read_string(FILE * file, size_t len) {
+    char * str = malloc(len + 1);
+    if(str == NULL || fread(str, 1, len, file) != len) {
+        free(str);
+        return NULL;
+    }
+    str[len] = '\0';
+    return str;
+}
+
+static int compare_sites(const void * a, const void * b) {
+    uint64_t x = ((const decoded_site_t *)a)->id;
+    uint64_t y = ((const decoded_site_t *)b)->id;
+    return (x > y) - (x < y);
+}
+
+static int compare_events(const void * a, const void * b) {
+    uint64_t x = ((const decoded_event_t *)a)->event.tsc;
+    uint64_t y = ((const decoded_event_t *)b)->event.tsc;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Print fmt with the raw arguments, each conversion is narrowed to the
+ * type given by its length modifier. %s prints the recorded address.
+ */
+static void print_message(const char * fmt, uint64_t * args, uint64_t nargs) {
+    uint64_t next = 0;
+    const char * p = fmt;
+
+    while(*p != '\0') {
+        if(*p != '%') {
+            putchar(*p++);
+            continue;
+        }
+        if(p[1] == '%') {
+            putchar('%');
+            p += 2;
+            continue;
+        }
+
+        // Copy one conversion: flags, width, precision, length, type
+        char spec[32];
+        size_t len = 0;
+        spec[len++] = *p++;
+        while(*p != '\0' && strchr("-+ #0123456789.hlzjt", *p) != NULL && len < sizeof(spec) - 2) {
+            spec[len++] = *p++;
+        }
+        char type = *p;
+        if(type == '\0') {
+            break;
+        }
+        p++;
+        spec[len++] = type;
+        spec[len] = '\0';
+
+        uint64_t arg = (next < nargs)?args[next]:0;
+        next++;
+        int longer = (strchr(spec, 'l') != NULL || strchr(spec, 'z') != NULL || strchr(spec, 'j') != NULL || strchr(spec, 't') != NULL);
+
+        switch(type) {
+            case 'd':
+            case 'i':
+                if(longer) {
+                    printf(spec, (long long)arg);
+                }
+                else {
+                    printf(spec, (int)arg);
+                }
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                if(longer) {
+                    printf(spec, (unsigned long long)arg);
+                }
+                else {
+                    printf(spec, (unsigned int)arg);
+                }
+                break;
+            case 'c':
+                printf(spec, (int)(char)arg);
+                break;
+            case 'p':
+                printf(spec, (void *)arg);
+                break;
+            case 's':
+                printf("<string@%p>", (void *)arg);
+                break;
+            default:
+                printf("%s", spec);
+                break;
+        }
+    }
+    putchar('\n');
+}
+
+int main(int argc, char * argv[]) {
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s <dump>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE * file = fopen(argv[1], "r");
+    if(file == NULL) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t header[4];
+    if(read_words(file, header, 4) != 0 || memcmp(header, TRACE_MAGIC, sizeof(uint64_t)) != 0) {
+        fprintf(stderr, "%s: not a trace dump\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    uint64_t ticks_per_us = header[1];
+    uint64_t site_count = header[2];
+    uint64_t ring_count = header[3];
+
+    decoded_site_t * sites = calloc(site_count + 1, sizeof(decoded_site_t));
+    for(uint64_t i = 0; i < site_count; i++) {
+        uint64_t words[7];
+        if(read_words(file, words, 7) != 0) {
+            fprintf(stderr, "%s: truncated sites\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        sites[i].id = words[0];
+        sites[i].level = words[1];
+        sites[i].line = words[2];
+        sites[i].nargs = words[3];
+        sites[i].file = read_string(file, words[4]);
+        sites[i].func = read_string(file, words[5]);
+        sites[i].fmt = read_string(file, words[6]);
+        if(sites[i].file == NULL || sites[i].func == NULL || sites[i].fmt == NULL) {
+            fprintf(stderr, "%s: truncated sites\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+    }
+    qsort(sites, site_count, sizeof(decoded_site_t), compare_sites);
+
+    decoded_event_t * events = NULL;
+    size_t event_count = 0;
+    for(uint64_t i = 0; i < ring_count; i++) {
+        uint64_t words[2];
+        if(read_words(file, words, 2) != 0) {
+            fprintf(stderr, "%s: truncated rings\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        events = realloc(events, (event_count + words[1])*sizeof(decoded_event_t));
+        if(events == NULL && event_count + words[1] != 0) {
+            fprintf(stderr, "out of memory\n");
+            return EXIT_FAILURE;
+        }
+        for(uint64_t j = 0; j < words[1]; j++) {
+            events[event_count].tid = words[0];
+            if(fread(&events[event_count].event, sizeof(trace_event_t), 1, file) != 1) {
+                fprintf(stderr, "%s: truncated rings\n", argv[1]);
+                return EXIT_FAILURE;
+            }
+            event_count++;
+        }
+    }
+    fclose(file);
+    qsort(events, event_count, sizeof(decoded_event_t), compare_events);
+
+    for(size_t i = 0; i < event_count; i++) {
+        trace_event_t * event = &events[i].event;
+        decoded_site_t key = {.id = event->site};
+        decoded_site_t * site = bsearch(&key, sites, site_count, sizeof(decoded_site_t), compare_sites);
+        double us = (double)(event->tsc - events[0].event.tsc)/((ticks_per_us != 0)?ticks_per_us:1);
+
+        if(site == NULL) {
+            printf("%12.3f %6ld unknown site %lx\n", us, events[i].tid, event->site);
+            continue;
+        }
+        printf("%12.3f %6ld %-7s %s:%s:%ld ", us, events[i].tid, (site->level < 5)?level_names[site->level]:"?", site->file, site->func, site->line);
+        print_message(site->fmt, event->args, (site->nargs < TRACE_MAX_ARGS)?site->nargs:TRACE_MAX_ARGS);
+    }
+
+    return EXIT_SUCCESS;
+}